@@ -104,6 +104,16 @@ struct ext2_super_block {
 };
 
 
+/* s_feature_compat: the image keeps a journal in s_journal_inum */
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+/* s_feature_ro_compat: superblock backups only in groups 0, 1, 3^n, 5^n, 7^n */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+/* s_feature_incompat: directory entries record the file type */
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+
+#define EXT2_SUPER_MAGIC 0xEF53
+
+
 /*
  * Structure of a blocks group descriptor
  */
@@ -120,6 +130,8 @@ struct ext2_group_desc
 	unsigned int   bg_reserved[3];
 };
 
+#define EXT2_DESC_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(struct ext2_group_desc))
+
 
 /*
  * Structure of an inode on the disk
@@ -173,6 +185,8 @@ struct ext2_inode {
  */
 /* Root inode */
 #define    EXT2_ROOT_INO         2
+/* Journal inode */
+#define    EXT2_JOURNAL_INO      8
 /* First non-reserved inode for old ext2 filesystems */
 #define EXT2_GOOD_OLD_FIRST_INO 11
 
@@ -0,0 +1,25 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename) {
+    printf("Applied %d blocks\n", apply_delta(img_filename, stdin));
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+
+    if (argc != 2) {
+        fprintf(stderr, "%s <image file name> < <delta stream>\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+
+    core_func(img_filename);
+
+    return 0;
+}
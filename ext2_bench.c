@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+
+#include "ext2_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 200
+#define FILES_PER_DIR 100
+
+/* image shapes, see build_items() */
+#define SHAPE_SMALL 0  /* many small files, FILES_PER_DIR per directory */
+#define SHAPE_HUGE  1  /* few files of the largest size supported */
+#define SHAPE_DEEP  2  /* one chain of directories, a file on each level */
+#define SHAPE_WIDE  3  /* every file in one directory */
+#define NUM_SHAPES  4
+
+static const char *shape_names[NUM_SHAPES] = {"small", "huge", "deep",
+                                              "wide"};
+static const int shape_file_sizes[NUM_SHAPES] = {2048, 256 * 1024, 2048,
+                                                 100};
+
+/* operations, each timed as one tool run: open_image() to close_image() */
+#define OP_MKDIR   0
+#define OP_CP      1
+#define OP_LOOKUP  2
+#define OP_LN      3
+#define OP_RM      4
+#define OP_RESTORE 5
+#define OP_CHECKER 6
+#define NUM_OPS    7
+
+static const char *op_names[NUM_OPS] = {"mkdir", "cp",      "lookup", "ln",
+                                        "rm",    "restore", "checker"};
+
+/* latencies in seconds, per op, warm [0] and cold [1] */
+static struct op_stats {
+    double *lat;
+    int num, max;
+} stats[NUM_OPS][2];
+
+static char **dirs = NULL, **files = NULL;
+static int n_dirs = 0, n_files = 0;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write back and evict the image's pages, so the next op reads the disk. */
+void drop_cache(const char *img_filename) {
+    int fd;
+
+    if ((fd = open(img_filename, O_RDONLY)) < 0) {
+        perror(img_filename);
+        exit(ENOENT);
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+void record(int op, int cold, double sec) {
+    struct op_stats *st = &stats[op][cold];
+
+    if (st->num == st->max) {
+        st->max = st->max ? st->max * 2 : 256;
+        if (!(st->lat = realloc(st->lat, st->max * sizeof(double)))) {
+            perror("realloc");
+            exit(ENOMEM);
+        }
+    }
+    st->lat[st->num++] = sec;
+}
+
+void timed_op(const char *img_filename, int op, int cold, const char *path,
+              const char *path2, FILE *data) {
+    double start;
+
+    if (cold) {
+        drop_cache(img_filename);
+    }
+
+    start = now_sec();
+    open_image(img_filename);
+    switch (op) {
+    case OP_MKDIR:
+        create_dir(path);
+        break;
+    case OP_CP:
+        create_reg(data, path);
+        break;
+    case OP_LOOKUP:
+        if (lookup_path(path) < 0) {
+            fprintf(stderr, "%s not found\n", path);
+            exit(ENOENT);
+        }
+        break;
+    case OP_LN:
+        create_lnk(path, path2, 0);
+        break;
+    case OP_RM:
+        remove_reg_or_lnk(path);
+        break;
+    case OP_RESTORE:
+        restore_reg_or_lnk(path);
+        break;
+    case OP_CHECKER:
+        check_image();
+        break;
+    }
+    close_image();
+    record(op, cold, now_sec() - start);
+}
+
+/* fmt takes prefix, then i if it has a %d */
+char *make_path(const char *fmt, const char *prefix, int i) {
+    char *path;
+
+    if (asprintf(&path, fmt, prefix, i) < 0) {
+        perror("asprintf");
+        exit(ENOMEM);
+    }
+    return path;
+}
+
+/* Paths to create for a shape; directories come parents first. */
+void build_items(int shape, int n) {
+    int depth;
+
+    switch (shape) {
+    case SHAPE_SMALL:
+        n_dirs = (n + FILES_PER_DIR - 1) / FILES_PER_DIR;
+        n_files = n;
+        break;
+    case SHAPE_HUGE:
+        n_dirs = 1;
+        n_files = n / 50 > 4 ? n / 50 : 4;
+        break;
+    case SHAPE_DEEP:
+        depth = n / 10 < MAX_DEPTH ? n / 10 : MAX_DEPTH;
+        n_dirs = n_files = depth > 1 ? depth : 1;
+        break;
+    case SHAPE_WIDE:
+        n_dirs = 1;
+        n_files = n;
+        break;
+    }
+
+    if (!(dirs = calloc(n_dirs, sizeof(char *))) ||
+        !(files = calloc(n_files, sizeof(char *)))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+    for (int i = 0; i < n_dirs; ++i) {
+        if (shape == SHAPE_DEEP) {
+            dirs[i] = make_path("%s/d%d", i ? dirs[i - 1] : "", i);
+        } else {
+            dirs[i] = make_path("/%s%03d", shape_names[shape], i);
+        }
+    }
+    for (int i = 0; i < n_files; ++i) {
+        files[i] = make_path("%s/f%05d",
+                             dirs[shape == SHAPE_SMALL ? i / FILES_PER_DIR
+                                  : shape == SHAPE_DEEP ? i
+                                                        : 0],
+                             i);
+    }
+}
+
+void free_items() {
+    for (int i = 0; i < n_dirs; ++i) {
+        free(dirs[i]);
+    }
+    for (int i = 0; i < n_files; ++i) {
+        free(files[i]);
+    }
+    free(dirs);
+    free(files);
+    dirs = files = NULL;
+    n_dirs = n_files = 0;
+}
+
+/* Source for cp: a fixed pattern, so every run copies the same bytes. */
+FILE *make_data(int size) {
+    FILE *fp;
+
+    if (!(fp = tmpfile())) {
+        perror("tmpfile");
+        exit(EIO);
+    }
+    for (int i = 0; i < size; ++i) {
+        fputc('a' + i % 26, fp);
+    }
+    fflush(fp);
+    return fp;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(const double *sorted, int num, double q) {
+    int i = (int)(q * num + 0.999999) - 1;
+    return sorted[i < 0 ? 0 : i];
+}
+
+/* One row per op and cache state that has samples. */
+void report(FILE *out, int json, int shape, int *n_rows) {
+    struct op_stats *st;
+    double total;
+
+    for (int op = 0; op < NUM_OPS; ++op) {
+        for (int cold = 0; cold < 2; ++cold) {
+            st = &stats[op][cold];
+            if (!st->num) {
+                continue;
+            }
+            qsort(st->lat, st->num, sizeof(double), cmp_double);
+            total = 0;
+            for (int i = 0; i < st->num; ++i) {
+                total += st->lat[i];
+            }
+            fprintf(out,
+                    json ? "%s  {\"shape\": \"%s\", \"op\": \"%s\", "
+                           "\"cache\": \"%s\", \"count\": %d, "
+                           "\"ops_per_sec\": %.1f, \"mean_us\": %.1f, "
+                           "\"p50_us\": %.1f, \"p90_us\": %.1f, "
+                           "\"p99_us\": %.1f, \"max_us\": %.1f}"
+                         : "%s%s,%s,%s,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f",
+                    json && *n_rows ? ",\n" : "",
+                    shape_names[shape], op_names[op], cold ? "cold" : "warm",
+                    st->num, st->num / total, total / st->num * 1e6,
+                    percentile(st->lat, st->num, 0.50) * 1e6,
+                    percentile(st->lat, st->num, 0.90) * 1e6,
+                    percentile(st->lat, st->num, 0.99) * 1e6,
+                    st->lat[st->num - 1] * 1e6);
+            if (!json) {
+                fputc('\n', out);
+            }
+            ++*n_rows;
+            st->num = 0;
+        }
+    }
+}
+
+/*
+ * Build an image of one shape and time every op on it. Odd items run
+ * cold, so each op has warm and cold samples from the same image.
+ */
+void core_func(int shape, int n, int size_mb, int runs, const char *dir,
+               int keep, FILE *out, int json, int *n_rows) {
+    char img_filename[4096], *link;
+    FILE *data;
+    int k, restorable;
+
+    snprintf(img_filename, sizeof(img_filename), "%s/ext2_bench_%s.img", dir,
+             shape_names[shape]);
+    unlink(img_filename);
+    make_image(img_filename, size_mb * 1024, 8192);
+
+    build_items(shape, n);
+    data = make_data(shape_file_sizes[shape]);
+    fprintf(stderr, "bench: %s: %d directories, %d files of %d bytes\n",
+            shape_names[shape], n_dirs, n_files, shape_file_sizes[shape]);
+
+    for (int i = 0; i < n_dirs; ++i) {
+        timed_op(img_filename, OP_MKDIR, i % 2, dirs[i], NULL, NULL);
+    }
+    for (int i = 0; i < n_files; ++i) {
+        timed_op(img_filename, OP_CP, i % 2, files[i], NULL, data);
+    }
+    for (int i = 0; i < n_files; ++i) {
+        timed_op(img_filename, OP_LOOKUP, i % 2, files[i], NULL, NULL);
+    }
+    for (int i = 0; i < n_files; ++i) {
+        link = make_path("%s.ln", files[i], 0);
+        timed_op(img_filename, OP_LN, i % 2, files[i], link, NULL);
+        free(link);
+    }
+    /* drop both names, so restore finds the inode free again */
+    k = 0;
+    for (int i = 0; i < n_files; ++i) {
+        link = make_path("%s.ln", files[i], 0);
+        timed_op(img_filename, OP_RM, k++ % 2, files[i], NULL, NULL);
+        timed_op(img_filename, OP_RM, k++ % 2, link, NULL, NULL);
+        free(link);
+    }
+    /* rm leaves nothing to restore for the first entry of a dir block */
+    k = 0;
+    for (int i = 0; i < n_files; ++i) {
+        open_image(img_filename);
+        restorable = lookup_deleted_path(files[i]) > 0;
+        close_image();
+        if (restorable) {
+            timed_op(img_filename, OP_RESTORE, k++ % 2, files[i], NULL, NULL);
+        }
+    }
+    if (k < n_files) {
+        fprintf(stderr, "bench: %s: %d files not restorable, skipped\n",
+                shape_names[shape], n_files - k);
+    }
+    for (int i = 0; i < 2 * runs; ++i) {
+        timed_op(img_filename, OP_CHECKER, i % 2, NULL, NULL, NULL);
+    }
+
+    report(out, json, shape, n_rows);
+
+    fclose(data);
+    free_items();
+    if (!keep) {
+        unlink(img_filename);
+    }
+}
+
+int main(int argc, char **argv) {
+    int shape = -1;        /* all shapes */
+    int n = 1000;          /* files per shape, scaled per shape */
+    int size_mb = 64;      /* image size */
+    int runs = 5;          /* checker runs, warm and cold each */
+    int json = 0, keep = 0, n_rows = 0;
+    const char *dir = "/tmp";
+    FILE *out;
+
+    argc = parse_image_opts(argc, argv);
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--keep")) {
+            keep = 1;
+            continue;
+        }
+        if (i + 1 == argc) {
+            goto usage;
+        }
+        if (!strcmp(argv[i], "--shape")) {
+            for (shape = 0; shape < NUM_SHAPES &&
+                            strcmp(argv[i + 1], shape_names[shape]);
+                 ++shape)
+                ;
+            if (shape == NUM_SHAPES) {
+                if (strcmp(argv[i + 1], "all")) {
+                    goto usage;
+                }
+                shape = -1;
+            }
+        } else if (!strcmp(argv[i], "--files")) {
+            n = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--size")) {
+            size_mb = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--runs")) {
+            runs = atoi(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--format")) {
+            if (strcmp(argv[i + 1], "csv") && strcmp(argv[i + 1], "json")) {
+                goto usage;
+            }
+            json = !strcmp(argv[i + 1], "json");
+        } else if (!strcmp(argv[i], "--dir")) {
+            dir = argv[i + 1];
+        } else {
+            goto usage;
+        }
+        ++i;
+    }
+    if (n < 1 || size_mb < 1 || runs < 0) {
+        goto usage;
+    }
+
+    /* results keep stdout, the tools' own messages are discarded */
+    if (!(out = fdopen(dup(STDOUT_FILENO), "w")) ||
+        !freopen("/dev/null", "w", stdout)) {
+        perror("stdout");
+        exit(EIO);
+    }
+
+    fprintf(out, json ? "[\n"
+                      : "shape,op,cache,count,ops_per_sec,mean_us,p50_us,"
+                        "p90_us,p99_us,max_us\n");
+    for (int s = 0; s < NUM_SHAPES; ++s) {
+        if (shape < 0 || s == shape) {
+            core_func(s, n, size_mb, runs, dir, keep, out, json, &n_rows);
+        }
+    }
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+    fclose(out);
+
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "%s [--shape small|huge|deep|wide|all] [--files N] "
+            "[--size MiB] [--runs N] [--format csv|json] [--dir path] "
+            "[--keep]\n",
+            argv[0]);
+    exit(EINVAL);
+}
@@ -0,0 +1,1249 @@
+#define _GNU_SOURCE
+
+#include "ext2_blockio.h"
+#include "ext2.h"
+#include "ext2_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define CACHE_BUCKETS 4096
+#define CACHE_MIN_SLOTS 16
+#define CACHE_DEFAULT_KB 4096
+#define URING_ENTRIES 64
+
+/* operations between two flushes under --durability=batch */
+#define BATCH_COMMIT_OPS 1024
+
+#define BIT_SET(bmp, n) ((bmp)[(n) / 8] |= 1 << ((n) % 8))
+#define BIT_CLR(bmp, n) ((bmp)[(n) / 8] &= ~(1 << ((n) % 8)))
+#define BIT_CHK(bmp, n) ((bmp)[(n) / 8] & (1 << ((n) % 8)))
+#define BLOCK_CLASS(n) (BIT_CHK(meta_bmp, n) ? BLOCK_META : BLOCK_DATA)
+
+/*
+ * Overlay delta file: this header, then a bitmap of the blocks present
+ * in the delta, then a sparse copy of the image where only those blocks
+ * were ever written.
+ */
+#define OVERLAY_MAGIC "EXT2OVL1"
+#define OVERLAY_DATA_OFF(n)                                                  \
+    ((off_t)(1 + ovl_index_blocks + (n)) * EXT2_BLOCK_SIZE)
+
+struct overlay_header {
+    char magic[8];
+    unsigned int n_blocks;
+    unsigned int n_index_blocks;
+};
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+struct cache_slot {
+    int n_block;
+    int type;
+    int pinned;
+    int dirty;
+    unsigned int epoch; /* operation that last got the block, 0 once put */
+    struct cache_slot *hash_next;
+    struct cache_slot *prev, *next; /* LRU list of its class, head is MRU */
+    unsigned char data[EXT2_BLOCK_SIZE];
+};
+
+struct cache_lru {
+    struct cache_slot *head, *tail;
+};
+
+struct uring {
+    int fd;
+    unsigned int entries;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+/* ------------------- buffer cache ------------------- */
+struct cache_slot *lookup_slot(int n_block);
+void link_slot(struct cache_slot *slot);
+void unlink_slot(struct cache_slot *slot);
+void touch_slot(struct cache_slot *slot, int to_head);
+struct cache_slot *evict_slot();
+struct cache_slot *alloc_slot();
+void read_slot(struct cache_slot *slot);
+void write_slot(struct cache_slot *slot);
+void drop_slot(struct cache_slot *slot);
+void transfer_slots(struct cache_slot **slots, int num, int write);
+/* ------------------- device ------------------- */
+int locate_dev(int n_block, int write, off_t *off);
+void read_dev(int n_block, void *buf);
+void write_dev(int n_block, const void *buf);
+void sync_dev();
+void open_overlay(const char *filename);
+void write_overlay_index();
+/* ------------------- commit ------------------- */
+void flush_range(int n_block, int num);
+/* ------------------- io_uring ------------------- */
+int setup_uring();
+void teardown_uring();
+void uring_transfer(struct cache_slot **slots, int num, int write);
+
+static int backend = BLOCKIO_MMAP;
+static int advice = 1;
+static int durability = DURABILITY_NONE;
+static long n_ops = 0;
+static commit_hook hook = NULL;
+
+/*
+ * per block: written since the last commit / since the last
+ * take_txn_blocks() / since the last take_changed_blocks() / last got
+ * as metadata
+ */
+static unsigned char *dirty_bmp = NULL;
+static unsigned char *txn_bmp = NULL;
+static unsigned char *changed_bmp = NULL;
+static unsigned char *meta_bmp = NULL;
+static int fd = -1;
+static int n_blocks = 0;
+
+/* --overlay: the image is read-only, written blocks go to the delta */
+static const char *ovl_path = NULL;
+static int ovl_fd = -1;
+static int ovl_index_blocks = 0;
+static int ovl_index_dirty = 0;
+static unsigned char *ovl_index = NULL;
+
+static unsigned char *disk = NULL;
+static size_t disk_size = 0;
+
+static long cache_max_slots = CACHE_DEFAULT_KB * 1024 / EXT2_BLOCK_SIZE;
+static long cache_num_slots = 0;
+static unsigned int cache_epoch = 1;
+static struct cache_slot *cache_hash[CACHE_BUCKETS];
+static struct cache_lru cache_lru[2];
+
+static struct uring ring = {.fd = -1};
+
+/* ----------- Public Functions ----------- */
+
+void set_blockio_backend(int new_backend) { backend = new_backend; }
+
+void set_blockio_advice(int enabled) { advice = enabled; }
+
+void set_blockio_durability(int mode) { durability = mode; }
+
+/*
+ * Let a journal see each operation's metadata and put its log write
+ * between the data and the metadata flush. While a hook is set, dirty
+ * metadata is never evicted: it may only reach its home location once
+ * the hook has logged it.
+ */
+void set_blockio_commit_hook(commit_hook new_hook) { hook = new_hook; }
+
+int get_blockio_backend() { return backend; }
+
+void set_blockio_overlay(const char *delta_filename) {
+    ovl_path = delta_filename;
+}
+
+const char *get_blockio_overlay() { return ovl_path; }
+
+void set_blockio_cache_size(long kbytes) {
+    cache_max_slots = kbytes * 1024 / EXT2_BLOCK_SIZE;
+    if (cache_max_slots < CACHE_MIN_SLOTS) {
+        cache_max_slots = CACHE_MIN_SLOTS;
+    }
+}
+
+void open_blockio(const char *filename) {
+    struct stat st;
+
+    if ((fd = open(filename, ovl_path ? O_RDONLY : O_RDWR)) == -1) {
+        perror("open");
+        exit(ENOENT);
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    disk_size = st.st_size;
+    n_blocks = st.st_size / EXT2_BLOCK_SIZE;
+
+    if (!(dirty_bmp = calloc(n_blocks / 8 + 1, 1)) ||
+        !(txn_bmp = calloc(n_blocks / 8 + 1, 1)) ||
+        !(changed_bmp = calloc(n_blocks / 8 + 1, 1)) ||
+        !(meta_bmp = calloc(n_blocks / 8 + 1, 1))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+
+    if (ovl_path) {
+        open_overlay(filename);
+    }
+
+    if (backend == BLOCKIO_MMAP) {
+        /* a private mapping keeps writes away from the base image */
+        if ((disk = mmap(NULL, disk_size, PROT_READ | PROT_WRITE,
+                         ovl_path ? MAP_PRIVATE : MAP_SHARED, fd, 0)) ==
+            MAP_FAILED) {
+            close(fd);
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; ovl_path && i < n_blocks; ++i) {
+            if (BIT_CHK(ovl_index, i)) {
+                read_dev(i, disk + (size_t)i * EXT2_BLOCK_SIZE);
+            }
+        }
+        /* most accesses are path lookups; read-around only wastes I/O */
+        if (advice) {
+            madvise(disk, disk_size, MADV_RANDOM);
+        }
+    }
+
+    /* without io_uring (old kernel, seccomp) batches fall back to pread */
+    if (backend == BLOCKIO_URING && setup_uring() != 0) {
+        teardown_uring();
+    }
+}
+
+void close_blockio() {
+    struct cache_slot *slot;
+
+    if (hook) {
+        hook(COMMIT_END_OP);
+        commit_blocks();
+    } else if (durability == DURABILITY_NONE) {
+        sync_blocks();
+    } else {
+        commit_blocks();
+    }
+
+    if (disk && munmap(disk, disk_size) != 0) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 2; ++i) {
+        while ((slot = cache_lru[i].head)) {
+            drop_slot(slot);
+        }
+    }
+    teardown_uring();
+    if (close(fd) != 0) {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+    if (ovl_fd >= 0) {
+        write_overlay_index();
+        if (close(ovl_fd) != 0) {
+            perror("close");
+            exit(EXIT_FAILURE);
+        }
+        free(ovl_index);
+        ovl_fd = -1;
+        ovl_index = NULL;
+    }
+
+    free(dirty_bmp);
+    free(txn_bmp);
+    free(changed_bmp);
+    free(meta_bmp);
+    dirty_bmp = txn_bmp = changed_bmp = meta_bmp = NULL;
+
+    fd = -1;
+    n_blocks = 0;
+    n_ops = 0;
+    disk = NULL;
+    disk_size = 0;
+}
+
+int count_blockio_blocks() { return n_blocks; }
+
+void *get_block(int n_block, int type) {
+    struct cache_slot *slot;
+
+    if (n_block < 0 || n_block >= n_blocks) {
+        fprintf(stderr, "block %d out of range\n", n_block);
+        exit(EIO);
+    }
+
+    if (type == BLOCK_META) {
+        BIT_SET(meta_bmp, n_block);
+    }
+
+    if (backend == BLOCKIO_MMAP) {
+        return disk + (size_t)EXT2_BLOCK_SIZE * n_block;
+    }
+
+    if ((slot = lookup_slot(n_block))) {
+        if (type > slot->type) {
+            unlink_slot(slot);
+            slot->type = type;
+            link_slot(slot);
+        }
+        touch_slot(slot, 1);
+    } else {
+        slot = alloc_slot();
+        slot->n_block = n_block;
+        slot->type = type;
+        slot->pinned = 0;
+        slot->dirty = 0;
+        read_slot(slot);
+        link_slot(slot);
+    }
+    slot->epoch = cache_epoch;
+
+    return slot->data;
+}
+
+/* Like get_block() for a block about to be overwritten: skip the read. */
+void *get_new_block(int n_block, int type) {
+    struct cache_slot *slot;
+
+    /* a reallocated block starts over in the class of its new owner */
+    if (n_block >= 0 && n_block < n_blocks && type == BLOCK_DATA) {
+        BIT_CLR(meta_bmp, n_block);
+    }
+
+    if (backend == BLOCKIO_MMAP || lookup_slot(n_block)) {
+        return get_block(n_block, type);
+    }
+    if (n_block < 0 || n_block >= n_blocks) {
+        fprintf(stderr, "block %d out of range\n", n_block);
+        exit(EIO);
+    }
+
+    slot = alloc_slot();
+    slot->n_block = n_block;
+    slot->type = type;
+    slot->pinned = 0;
+    slot->dirty = 0;
+    slot->epoch = cache_epoch;
+    memset(slot->data, 0, EXT2_BLOCK_SIZE);
+    link_slot(slot);
+
+    return slot->data;
+}
+
+/*
+ * Read every listed block that is not cached yet in one batch, so the
+ * get_block() calls that follow hit the cache. Zero entries (holes) and
+ * out-of-range numbers are ignored. A no-op for the mmap backend.
+ */
+void prefetch_blocks(const int *blocks, int num, int type) {
+    struct cache_slot **slots;
+    int n;
+
+    if (num <= 0) {
+        return;
+    }
+    if (backend == BLOCKIO_MMAP) {
+        for (int i = 0; i < num; ++i) {
+            if (blocks[i] > 0) {
+                advise_blocks(blocks[i], 1, BLOCKIO_ADV_WILLNEED);
+            }
+        }
+        return;
+    }
+    if (!(slots = malloc(num * sizeof(struct cache_slot *)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    n = 0;
+    for (int i = 0; i < num; ++i) {
+        if (blocks[i] <= 0 || blocks[i] >= n_blocks || lookup_slot(blocks[i])) {
+            continue;
+        }
+        /* held by this epoch so later slots of the batch cannot evict it */
+        slots[n] = alloc_slot();
+        slots[n]->n_block = blocks[i];
+        slots[n]->type = type;
+        slots[n]->pinned = 0;
+        slots[n]->dirty = 0;
+        slots[n]->epoch = cache_epoch;
+        link_slot(slots[n]);
+        ++n;
+    }
+
+    transfer_slots(slots, n, 0);
+
+    for (int i = 0; i < n; ++i) {
+        slots[i]->epoch = 0;
+    }
+    free(slots);
+}
+
+void put_block(int n_block) {
+    struct cache_slot *slot;
+
+    if (backend != BLOCKIO_MMAP && (slot = lookup_slot(n_block))) {
+        slot->epoch = 0;
+        touch_slot(slot, 0);
+    }
+}
+
+void pin_block(int n_block) {
+    struct cache_slot *slot;
+
+    get_block(n_block, BLOCK_META);
+    if (backend != BLOCKIO_MMAP) {
+        slot = lookup_slot(n_block);
+        slot->pinned = 1;
+    }
+}
+
+void mark_block_dirty(int n_block) {
+    struct cache_slot *slot;
+
+    if (n_block < 0 || n_block >= n_blocks) {
+        return;
+    }
+    BIT_SET(dirty_bmp, n_block);
+    BIT_SET(txn_bmp, n_block);
+    BIT_SET(changed_bmp, n_block);
+    if (backend != BLOCKIO_MMAP && (slot = lookup_slot(n_block))) {
+        slot->dirty = 1;
+    }
+}
+
+/*
+ * End of an operation: blocks got so far may be evicted from now on, and
+ * the cache shrinks back to its budget, dropping data before metadata.
+ */
+void release_blocks() {
+    struct cache_slot *slot;
+
+    if (hook) {
+        hook(COMMIT_END_OP);
+    }
+    ++n_ops;
+    if (durability == DURABILITY_COMMIT ||
+        (durability == DURABILITY_BATCH && n_ops % BATCH_COMMIT_OPS == 0)) {
+        commit_blocks();
+    }
+
+    if (backend == BLOCKIO_MMAP) {
+        return;
+    }
+
+    if (++cache_epoch == 0) {
+        cache_epoch = 1;
+    }
+    while (cache_num_slots > cache_max_slots && (slot = evict_slot())) {
+        free(slot);
+        --cache_num_slots;
+    }
+}
+
+void sync_blocks() {
+    struct cache_slot *slot;
+    struct cache_slot **slots;
+    int n;
+
+    if (backend == BLOCKIO_MMAP) {
+        /* the private overlay mapping is only written back by hand */
+        for (int i = 0; ovl_fd >= 0 && i < n_blocks; ++i) {
+            if (BIT_CHK(dirty_bmp, i)) {
+                write_dev(i, disk + (size_t)i * EXT2_BLOCK_SIZE);
+            }
+        }
+        return;
+    }
+    if (!(slots = malloc((cache_num_slots + 1) *
+                         sizeof(struct cache_slot *)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    n = 0;
+    for (int i = 0; i < 2; ++i) {
+        for (slot = cache_lru[i].head; slot; slot = slot->next) {
+            if (slot->dirty) {
+                slots[n++] = slot;
+            }
+        }
+    }
+    transfer_slots(slots, n, 1);
+
+    free(slots);
+}
+
+/*
+ * Make everything written so far durable: data blocks first, then the
+ * metadata that points at them, so a crash in between never leaves
+ * metadata referring to unwritten data.
+ */
+void commit_blocks() {
+    flush_class(BLOCK_DATA);
+    if (hook) {
+        hook(COMMIT_LOG);
+    }
+    flush_class(BLOCK_META);
+    if (hook) {
+        hook(COMMIT_DONE);
+    }
+    memset(dirty_bmp, 0, n_blocks / 8 + 1);
+}
+
+/* Drop every unpinned cached block, e.g. after the image changed below. */
+void invalidate_blocks() {
+    struct cache_slot *slot, *prev;
+
+    for (int i = 0; i < 2; ++i) {
+        for (slot = cache_lru[i].tail; slot; slot = prev) {
+            prev = slot->prev;
+            if (!slot->pinned) {
+                drop_slot(slot);
+            }
+        }
+    }
+}
+
+/*
+ * Store the metadata blocks written since the last call in blocks (room
+ * for count_blockio_blocks() entries) and return how many there are.
+ */
+int take_txn_blocks(int *blocks) {
+    int num;
+
+    num = 0;
+    for (int i = 0; i < n_blocks; ++i) {
+        if (BIT_CHK(txn_bmp, i)) {
+            BIT_CLR(txn_bmp, i);
+            if (BLOCK_CLASS(i) == BLOCK_META) {
+                blocks[num++] = i;
+            }
+        }
+    }
+
+    return num;
+}
+
+/* Like take_txn_blocks(), for every block written by any means. */
+int take_changed_blocks(int *blocks) {
+    int num;
+
+    num = 0;
+    for (int i = 0; i < n_blocks; ++i) {
+        if (BIT_CHK(changed_bmp, i)) {
+            BIT_CLR(changed_bmp, i);
+            blocks[num++] = i;
+        }
+    }
+
+    return num;
+}
+
+int get_block_class(int n_block) { return BLOCK_CLASS(n_block); }
+
+/* Unbuffered access that bypasses (and does not update) the cache. */
+void read_raw_block(int n_block, void *buf) { read_dev(n_block, buf); }
+
+void write_raw_block(int n_block, const void *buf) {
+    write_dev(n_block, buf);
+    BIT_SET(changed_bmp, n_block);
+}
+
+/*
+ * Runs of raw blocks in one transfer, unless the overlay splits them.
+ * Only reads state, so reader threads may call it while nothing writes.
+ */
+void read_raw_blocks(int n_block, int num, void *buf) {
+    size_t len = (size_t)num * EXT2_BLOCK_SIZE;
+    ssize_t n;
+
+    if (ovl_fd >= 0) {
+        for (int i = 0; i < num; ++i) {
+            read_dev(n_block + i, (char *)buf + i * EXT2_BLOCK_SIZE);
+        }
+        return;
+    }
+    if ((n = pread(fd, buf, len, (off_t)n_block * EXT2_BLOCK_SIZE)) < 0) {
+        perror("pread");
+        exit(EIO);
+    }
+    if (n < len) {
+        memset((char *)buf + n, 0, len - n);
+    }
+}
+
+void write_raw_blocks(int n_block, int num, const void *buf) {
+    size_t len = (size_t)num * EXT2_BLOCK_SIZE;
+
+    STAT_ADD(bytes_copied, len);
+    for (int i = 0; i < num; ++i) {
+        BIT_SET(changed_bmp, n_block + i);
+    }
+    if (ovl_fd >= 0) {
+        for (int i = 0; i < num; ++i) {
+            write_dev(n_block + i, (const char *)buf + i * EXT2_BLOCK_SIZE);
+        }
+        return;
+    }
+    if (pwrite(fd, buf, len, (off_t)n_block * EXT2_BLOCK_SIZE) != len) {
+        perror("pwrite");
+        exit(EIO);
+    }
+}
+
+void sync_raw_blocks() { sync_dev(); }
+
+/*
+ * Blocks from n_block on as mapped by the mmap backend, to be written out
+ * with no copy, or NULL for the buffered backends. Any thread may read
+ * through it while nothing writes the range.
+ */
+const void *map_raw_blocks(int n_block) {
+    if (backend != BLOCKIO_MMAP) {
+        return NULL;
+    }
+    return disk + (size_t)EXT2_BLOCK_SIZE * n_block;
+}
+
+/*
+ * Forget any cached copy of the range and punch it out of the image, or
+ * out of the delta in overlay mode, where the base is never touched.
+ */
+int discard_blocks(int n_block, int num) {
+    struct cache_slot *slot;
+
+    for (int i = n_block; i < n_block + num; ++i) {
+        if ((slot = lookup_slot(i))) {
+            drop_slot(slot);
+        }
+        if (i < n_blocks) {
+            BIT_CLR(dirty_bmp, i);
+            BIT_CLR(txn_bmp, i);
+        }
+    }
+
+    if (ovl_fd >= 0) {
+        for (int i = n_block; i < n_block + num && i < n_blocks; ++i) {
+            BIT_SET(ovl_index, i);
+        }
+        ovl_index_dirty = 1;
+        if (fallocate(ovl_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      OVERLAY_DATA_OFF(n_block),
+                      (off_t)num * EXT2_BLOCK_SIZE) != 0) {
+            perror("fallocate");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)n_block * EXT2_BLOCK_SIZE,
+                  (off_t)num * EXT2_BLOCK_SIZE) != 0) {
+        perror("fallocate");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy every block of an overlay delta into its base image and remove
+ * the delta. Returns the number of blocks merged.
+ */
+int merge_overlay(const char *filename, const char *delta_filename) {
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    int base_fd;
+    int n_merged;
+
+    if ((base_fd = open(filename, O_RDWR)) == -1) {
+        perror("open");
+        exit(ENOENT);
+    }
+
+    set_blockio_backend(BLOCKIO_CACHE);
+    ovl_path = delta_filename;
+    open_blockio(filename);
+    ovl_path = NULL;
+
+    n_merged = 0;
+    for (int i = 0; i < n_blocks; ++i) {
+        if (BIT_CHK(ovl_index, i)) {
+            read_dev(i, buf);
+            if (pwrite(base_fd, buf, EXT2_BLOCK_SIZE,
+                       (off_t)i * EXT2_BLOCK_SIZE) != EXT2_BLOCK_SIZE) {
+                perror("pwrite");
+                exit(EIO);
+            }
+            ++n_merged;
+        }
+    }
+
+    close_blockio();
+    if (fdatasync(base_fd) != 0 || close(base_fd) != 0) {
+        perror("close");
+        exit(EIO);
+    }
+    if (unlink(delta_filename) != 0) {
+        perror("unlink");
+        exit(EXIT_FAILURE);
+    }
+
+    return n_merged;
+}
+
+/*
+ * Hint how a range of blocks is about to be accessed. Failures are
+ * ignored: the hints only affect speed. The cache backend only acts on
+ * WILLNEED, by reading the range ahead.
+ */
+void advise_blocks(int n_block, int num, int adv) {
+    static const int madv[] = {MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED};
+    size_t page, start, end;
+    int *blocks;
+
+    if (!advice || num <= 0) {
+        return;
+    }
+
+    if (backend != BLOCKIO_MMAP) {
+        if (adv != BLOCKIO_ADV_WILLNEED) {
+            return;
+        }
+        if (!(blocks = malloc(num * sizeof(int)))) {
+            perror("malloc");
+            exit(ENOMEM);
+        }
+        for (int i = 0; i < num; ++i) {
+            blocks[i] = n_block + i;
+        }
+        prefetch_blocks(blocks, num, BLOCK_META);
+        free(blocks);
+        return;
+    }
+
+    page = sysconf(_SC_PAGESIZE);
+    start = (size_t)n_block * EXT2_BLOCK_SIZE / page * page;
+    end = (size_t)(n_block + num) * EXT2_BLOCK_SIZE;
+    if (end > disk_size) {
+        end = disk_size;
+    }
+    if (start < end) {
+        madvise(disk + start, end - start, madv[adv]);
+    }
+}
+
+/*
+ * Fault a range in up front, backed by transparent huge pages where the
+ * host allows it: MAP_POPULATE limited to the hot metadata.
+ */
+void populate_blocks(int n_block, int num) {
+    size_t page, start, end;
+    volatile unsigned char sink;
+
+    if (backend != BLOCKIO_MMAP || num <= 0) {
+        return;
+    }
+
+    page = sysconf(_SC_PAGESIZE);
+    start = (size_t)n_block * EXT2_BLOCK_SIZE / page * page;
+    end = (size_t)(n_block + num) * EXT2_BLOCK_SIZE;
+    if (end > disk_size) {
+        end = disk_size;
+    }
+    if (start >= end) {
+        return;
+    }
+
+    madvise(disk + start, end - start, MADV_HUGEPAGE);
+    if (madvise(disk + start, end - start, MADV_POPULATE_WRITE) != 0) {
+        /* older kernels: touch every page instead */
+        for (size_t off = start; off < end; off += page) {
+            sink = disk[off];
+        }
+        (void)sink;
+    }
+}
+
+/* ----------- Private Functions ----------- */
+
+/* ------------------- buffer cache ------------------- */
+
+struct cache_slot *lookup_slot(int n_block) {
+    struct cache_slot *slot;
+
+    for (slot = cache_hash[n_block % CACHE_BUCKETS]; slot;
+         slot = slot->hash_next) {
+        if (slot->n_block == n_block) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+void link_slot(struct cache_slot *slot) {
+    struct cache_lru *lru;
+
+    slot->hash_next = cache_hash[slot->n_block % CACHE_BUCKETS];
+    cache_hash[slot->n_block % CACHE_BUCKETS] = slot;
+
+    lru = &cache_lru[slot->type];
+    slot->prev = NULL;
+    slot->next = lru->head;
+    if (lru->head) {
+        lru->head->prev = slot;
+    } else {
+        lru->tail = slot;
+    }
+    lru->head = slot;
+}
+
+void unlink_slot(struct cache_slot *slot) {
+    struct cache_slot **pslot;
+    struct cache_lru *lru;
+
+    for (pslot = &cache_hash[slot->n_block % CACHE_BUCKETS]; *pslot != slot;
+         pslot = &(*pslot)->hash_next)
+        ;
+    *pslot = slot->hash_next;
+
+    lru = &cache_lru[slot->type];
+    if (slot->prev) {
+        slot->prev->next = slot->next;
+    } else {
+        lru->head = slot->next;
+    }
+    if (slot->next) {
+        slot->next->prev = slot->prev;
+    } else {
+        lru->tail = slot->prev;
+    }
+}
+
+void touch_slot(struct cache_slot *slot, int to_head) {
+    struct cache_lru *lru;
+
+    lru = &cache_lru[slot->type];
+    if ((to_head && lru->head == slot) || (!to_head && lru->tail == slot)) {
+        return;
+    }
+
+    if (slot->prev) {
+        slot->prev->next = slot->next;
+    } else {
+        lru->head = slot->next;
+    }
+    if (slot->next) {
+        slot->next->prev = slot->prev;
+    } else {
+        lru->tail = slot->prev;
+    }
+
+    if (to_head) {
+        slot->prev = NULL;
+        slot->next = lru->head;
+        lru->head->prev = slot;
+        lru->head = slot;
+    } else {
+        slot->next = NULL;
+        slot->prev = lru->tail;
+        lru->tail->next = slot;
+        lru->tail = slot;
+    }
+}
+
+/* Take the least recent unpinned block not in use by this operation. */
+struct cache_slot *evict_slot() {
+    struct cache_slot *slot;
+
+    for (int i = BLOCK_DATA; i <= BLOCK_META; ++i) {
+        for (slot = cache_lru[i].tail; slot; slot = slot->prev) {
+            if (hook && slot->dirty &&
+                BLOCK_CLASS(slot->n_block) == BLOCK_META) {
+                continue;
+            }
+            if (!slot->pinned && slot->epoch != cache_epoch) {
+                if (slot->dirty) {
+                    write_slot(slot);
+                }
+                unlink_slot(slot);
+                return slot;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+struct cache_slot *alloc_slot() {
+    struct cache_slot *slot;
+
+    if (cache_num_slots >= cache_max_slots && (slot = evict_slot())) {
+        return slot;
+    }
+    if (!(slot = malloc(sizeof(struct cache_slot)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    ++cache_num_slots;
+
+    return slot;
+}
+
+void read_slot(struct cache_slot *slot) { read_dev(slot->n_block, slot->data); }
+
+void write_slot(struct cache_slot *slot) {
+    write_dev(slot->n_block, slot->data);
+    slot->dirty = 0;
+}
+
+void drop_slot(struct cache_slot *slot) {
+    unlink_slot(slot);
+    free(slot);
+    --cache_num_slots;
+}
+
+/* Read or write back a set of slots, as one io_uring batch if available. */
+void transfer_slots(struct cache_slot **slots, int num, int write) {
+    if (ring.fd >= 0) {
+        uring_transfer(slots, num, write);
+        return;
+    }
+    for (int i = 0; i < num; ++i) {
+        if (write) {
+            write_slot(slots[i]);
+        } else {
+            read_slot(slots[i]);
+        }
+    }
+}
+
+/* ------------------- commit ------------------- */
+
+/*
+ * Flush the dirty blocks of one class. Under mmap every run of adjacent
+ * dirty blocks becomes one msync(MS_SYNC); the cache writes its dirty
+ * slots back as a batch and then fdatasync()s the image.
+ */
+void flush_class(int type) {
+    struct cache_slot *slot;
+    struct cache_slot **slots;
+    int n_start, n;
+
+    if (backend == BLOCKIO_MMAP && ovl_fd >= 0) {
+        for (int i = 0; i < n_blocks; ++i) {
+            if (BIT_CHK(dirty_bmp, i) && BLOCK_CLASS(i) == type) {
+                write_dev(i, disk + (size_t)i * EXT2_BLOCK_SIZE);
+            }
+        }
+        sync_dev();
+        return;
+    }
+
+    if (backend == BLOCKIO_MMAP) {
+        n_start = -1;
+        for (int i = 0; i <= n_blocks; ++i) {
+            if (i < n_blocks && BIT_CHK(dirty_bmp, i) &&
+                BLOCK_CLASS(i) == type) {
+                if (n_start < 0) {
+                    n_start = i;
+                }
+            } else if (n_start >= 0) {
+                flush_range(n_start, i - n_start);
+                n_start = -1;
+            }
+        }
+        return;
+    }
+
+    if (!(slots = malloc((cache_num_slots + 1) *
+                         sizeof(struct cache_slot *)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    n = 0;
+    for (int i = 0; i < 2; ++i) {
+        for (slot = cache_lru[i].head; slot; slot = slot->next) {
+            if (slot->dirty && BLOCK_CLASS(slot->n_block) == type) {
+                slots[n++] = slot;
+            }
+        }
+    }
+    transfer_slots(slots, n, 1);
+    free(slots);
+
+    sync_dev();
+}
+
+void flush_range(int n_block, int num) {
+    size_t page, start, end;
+
+    page = sysconf(_SC_PAGESIZE);
+    start = (size_t)n_block * EXT2_BLOCK_SIZE / page * page;
+    end = (size_t)(n_block + num) * EXT2_BLOCK_SIZE;
+    if (end > disk_size) {
+        end = disk_size;
+    }
+    if (msync(disk + start, end - start, MS_SYNC) != 0) {
+        perror("msync");
+        exit(EIO);
+    }
+}
+
+/* ------------------- device ------------------- */
+
+/*
+ * Pick the file and offset holding a block: the delta for blocks it has
+ * (or is about to get, when writing), the image otherwise.
+ */
+int locate_dev(int n_block, int write, off_t *off) {
+    if (ovl_fd >= 0 && (write || BIT_CHK(ovl_index, n_block))) {
+        if (write && !BIT_CHK(ovl_index, n_block)) {
+            BIT_SET(ovl_index, n_block);
+            ovl_index_dirty = 1;
+        }
+        *off = OVERLAY_DATA_OFF(n_block);
+        return ovl_fd;
+    }
+    *off = (off_t)n_block * EXT2_BLOCK_SIZE;
+    return fd;
+}
+
+void read_dev(int n_block, void *buf) {
+    ssize_t len;
+    off_t off;
+    int dev;
+
+    dev = locate_dev(n_block, 0, &off);
+    if ((len = pread(dev, buf, EXT2_BLOCK_SIZE, off)) < 0) {
+        perror("pread");
+        exit(EIO);
+    }
+    if (len < EXT2_BLOCK_SIZE) {
+        memset((char *)buf + len, 0, EXT2_BLOCK_SIZE - len);
+    }
+}
+
+void write_dev(int n_block, const void *buf) {
+    off_t off;
+    int dev;
+
+    dev = locate_dev(n_block, 1, &off);
+    if (pwrite(dev, buf, EXT2_BLOCK_SIZE, off) != EXT2_BLOCK_SIZE) {
+        perror("pwrite");
+        exit(EIO);
+    }
+}
+
+/* In overlay mode the index is only stored once the blocks it lists are. */
+void sync_dev() {
+    if (fdatasync(ovl_fd >= 0 ? ovl_fd : fd) != 0) {
+        perror("fdatasync");
+        exit(EIO);
+    }
+    if (ovl_fd >= 0 && ovl_index_dirty) {
+        write_overlay_index();
+        if (fdatasync(ovl_fd) != 0) {
+            perror("fdatasync");
+            exit(EIO);
+        }
+    }
+}
+
+/* Open the delta named by --overlay, creating an empty sparse one. */
+void open_overlay(const char *filename) {
+    struct overlay_header header;
+    struct stat st;
+
+    ovl_index_blocks = (n_blocks / 8 + EXT2_BLOCK_SIZE) / EXT2_BLOCK_SIZE;
+    if (!(ovl_index = calloc(ovl_index_blocks, EXT2_BLOCK_SIZE))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+
+    if ((ovl_fd = open(ovl_path, O_RDWR | O_CREAT, 0644)) == -1 ||
+        fstat(ovl_fd, &st) != 0) {
+        perror(ovl_path);
+        exit(ENOENT);
+    }
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+        header.n_blocks = n_blocks;
+        header.n_index_blocks = ovl_index_blocks;
+        if (pwrite(ovl_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            ftruncate(ovl_fd, OVERLAY_DATA_OFF(n_blocks)) != 0) {
+            perror(ovl_path);
+            exit(EIO);
+        }
+        return;
+    }
+
+    if (pread(ovl_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) ||
+        header.n_blocks != n_blocks ||
+        header.n_index_blocks != ovl_index_blocks) {
+        fprintf(stderr, "%s is not an overlay of %s\n", ovl_path, filename);
+        exit(EINVAL);
+    }
+    if (pread(ovl_fd, ovl_index, ovl_index_blocks * EXT2_BLOCK_SIZE,
+              EXT2_BLOCK_SIZE) < 0) {
+        perror(ovl_path);
+        exit(EIO);
+    }
+}
+
+void write_overlay_index() {
+    if (pwrite(ovl_fd, ovl_index, ovl_index_blocks * EXT2_BLOCK_SIZE,
+               EXT2_BLOCK_SIZE) != ovl_index_blocks * EXT2_BLOCK_SIZE) {
+        perror(ovl_path);
+        exit(EIO);
+    }
+    ovl_index_dirty = 0;
+}
+
+/* ------------------- io_uring ------------------- */
+
+/*
+ * liburing is not assumed, so the rings are set up with the raw syscalls
+ * and mapped by hand as described in io_uring_setup(2).
+ */
+int setup_uring() {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        return -1;
+    }
+    ring.entries = p.sq_entries;
+
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        ring.sq_ptr = NULL;
+        return -1;
+    }
+    if ((ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        ring.cq_ptr = NULL;
+        return -1;
+    }
+    if ((ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring.fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        ring.sqes = NULL;
+        return -1;
+    }
+
+    ring.sq_head = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.array);
+    ring.cq_head = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes =
+        (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+void teardown_uring() {
+    if (ring.sqes) {
+        munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring.cq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    if (ring.sq_ptr) {
+        munmap(ring.sq_ptr, ring.sq_size);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/*
+ * Queue up to a ring's worth of requests, submit them and reap all
+ * completions before the next chunk. The kernel may consume fewer SQEs
+ * than asked for; the rest stay queued and are submitted again, since
+ * reaping waits for a completion per request in the chunk.
+ */
+void uring_transfer(struct cache_slot **slots, int num, int write) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct cache_slot *slot;
+    unsigned int tail, head;
+    int chunk, done, ret;
+    off_t off;
+
+    for (int i = 0; i < num; i += chunk) {
+        chunk = num - i < (int)ring.entries ? num - i : (int)ring.entries;
+
+        tail = *ring.sq_tail;
+        for (int j = 0; j < chunk; ++j, ++tail) {
+            sqe = &ring.sqes[tail & *ring.sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = locate_dev(slots[i + j]->n_block, write, &off);
+            sqe->addr = (unsigned long)slots[i + j]->data;
+            sqe->len = EXT2_BLOCK_SIZE;
+            sqe->off = off;
+            sqe->user_data = (unsigned long)slots[i + j];
+            ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+        }
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        for (done = 0; done < chunk; done += ret) {
+            if ((ret = syscall(__NR_io_uring_enter, ring.fd, chunk - done, 0,
+                               0, NULL, 0)) < 0) {
+                perror("io_uring_enter");
+                exit(EIO);
+            }
+            if (ret == 0) {
+                fprintf(stderr, "io_uring_enter: no request submitted\n");
+                exit(EIO);
+            }
+        }
+
+        for (done = 0; done < chunk;) {
+            head = *ring.cq_head;
+            if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+                if (syscall(__NR_io_uring_enter, ring.fd, 0, chunk - done,
+                            IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                    perror("io_uring_enter");
+                    exit(EIO);
+                }
+                continue;
+            }
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            slot = (struct cache_slot *)(unsigned long)cqe->user_data;
+            if (cqe->res < 0 || (write && cqe->res != EXT2_BLOCK_SIZE)) {
+                fprintf(stderr, "%s block %d: %s\n", write ? "write" : "read",
+                        slot->n_block,
+                        strerror(cqe->res < 0 ? -cqe->res : EIO));
+                exit(EIO);
+            }
+            if (write) {
+                slot->dirty = 0;
+            } else if (cqe->res < EXT2_BLOCK_SIZE) {
+                memset(slot->data + cqe->res, 0, EXT2_BLOCK_SIZE - cqe->res);
+            }
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            ++done;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef _EXT2_BLOCKIO_
+#define _EXT2_BLOCKIO_
+
+/* block I/O backends */
+#define BLOCKIO_MMAP  0  /* whole image mapped MAP_SHARED */
+#define BLOCKIO_CACHE 1  /* pread/pwrite LRU buffer cache */
+#define BLOCKIO_URING 2  /* buffer cache filled/flushed in io_uring batches */
+
+/* block classes for the buffer cache, data is evicted first */
+#define BLOCK_DATA 0
+#define BLOCK_META 1
+
+/* access pattern hints, madvise() for mmap and read-ahead for the cache */
+#define BLOCKIO_ADV_RANDOM     0
+#define BLOCKIO_ADV_SEQUENTIAL 1
+#define BLOCKIO_ADV_WILLNEED   2
+
+/* when written blocks are forced to stable storage */
+#define DURABILITY_NONE   0  /* left to the kernel */
+#define DURABILITY_COMMIT 1  /* at the end of every operation */
+#define DURABILITY_BATCH  2  /* every few thousand operations and at close */
+
+/* stages a commit hook is called at, see set_blockio_commit_hook() */
+#define COMMIT_END_OP 0  /* an operation finished, its blocks are final */
+#define COMMIT_LOG    1  /* data is stable, metadata not yet written */
+#define COMMIT_DONE   2  /* metadata written in place and stable */
+
+typedef void (*commit_hook)(int stage);
+
+void set_blockio_backend(int backend);
+void set_blockio_cache_size(long kbytes);
+void set_blockio_advice(int enabled);
+void set_blockio_durability(int mode);
+void set_blockio_commit_hook(commit_hook hook);
+int get_blockio_backend();
+void set_blockio_overlay(const char *delta_filename);
+const char *get_blockio_overlay();
+int merge_overlay(const char *filename, const char *delta_filename);
+void open_blockio(const char *filename);
+void close_blockio();
+int count_blockio_blocks();
+
+/*
+ * A block returned by get_block() stays valid until put_block() or the end
+ * of the current operation (release_blocks()), whichever comes first.
+ * Writers must call mark_block_dirty() so the cache writes the block back.
+ */
+void *get_block(int n_block, int type);
+void *get_new_block(int n_block, int type);
+void prefetch_blocks(const int *blocks, int num, int type);
+void put_block(int n_block);
+void pin_block(int n_block);
+void mark_block_dirty(int n_block);
+void release_blocks();
+void sync_blocks();
+void commit_blocks();
+void flush_class(int type);
+int discard_blocks(int n_block, int num);
+void invalidate_blocks();
+int take_txn_blocks(int *blocks);
+int take_changed_blocks(int *blocks);
+int get_block_class(int n_block);
+void read_raw_block(int n_block, void *buf);
+void write_raw_block(int n_block, const void *buf);
+void read_raw_blocks(int n_block, int num, void *buf);
+void write_raw_blocks(int n_block, int num, const void *buf);
+void sync_raw_blocks();
+const void *map_raw_blocks(int n_block);
+void advise_blocks(int n_block, int num, int advice);
+void populate_blocks(int n_block, int num);
+
+#endif /* _EXT2_BLOCKIO_ */
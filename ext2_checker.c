@@ -14,6 +14,8 @@ void core_func(const char *img_filename) {
 int main(int argc, char **argv) {
     char *img_filename;  /* image filename */
 
+    argc = parse_image_opts(argc, argv);
+
     if (argc != 2) {
         fprintf(stderr, "%s <image file name>\n", argv[0]);
         exit(EINVAL);
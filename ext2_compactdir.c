@@ -0,0 +1,51 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename, const char *dir_path, int flags) {
+    if (dir_path[0] != '/') {
+        fprintf(stderr, "invalid disk path found\n");
+        exit(EINVAL);
+    }
+    open_image(img_filename);
+    compact_dir(dir_path, flags);
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    char *dir_path;      /* directory path on image */
+    int flags;           /* COMPACT_* flags */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc < 3) {
+        fprintf(stderr, "%s <image file name> <path> [-r] [-s] [-k]\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    dir_path = argv[2];
+    flags = 0;
+
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "-r")) {
+            flags |= COMPACT_RECURSIVE;
+        } else if (!strcmp(argv[i], "-s")) {
+            flags |= COMPACT_SORT;
+        } else if (!strcmp(argv[i], "-k")) {
+            flags |= COMPACT_KEEP_DELETED;
+        } else {
+            fprintf(stderr, "%s <image file name> <path> [-r] [-s] [-k]\n", argv[0]);
+            exit(EINVAL);
+        }
+    }
+
+    core_func(img_filename, dir_path, flags);
+
+    return 0;
+}
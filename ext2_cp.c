@@ -4,20 +4,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 
-void core_func(const char *img_filename, const char *src_filename, const char *dst_path) {
+void core_func(const char *img_filename, const char *src_filename, const char *dst_path,
+               int recursive, int n_readers, int update, int append) {
     FILE *fp;
     if (dst_path[0] != '/') {
         fprintf(stderr, "invalid disk path found\n");
         exit(EINVAL);
     }
+    if (recursive) {
+        open_image(img_filename);
+        import_tree(src_filename, dst_path, n_readers);
+        close_image();
+        return;
+    }
     if (!(fp = fopen(src_filename, "rb"))) {
         perror("fopen");
         exit(EINVAL);
     }
     open_image(img_filename);
-    create_reg(fp, dst_path);
+    if (update) {
+        update_reg(fp, dst_path);
+    } else if (append) {
+        append_reg(fp, dst_path);
+    } else {
+        create_reg(fp, dst_path);
+    }
     close_image();
     fclose(fp);
 }
@@ -26,18 +40,48 @@ int main(int argc, char **argv) {
     char *img_filename;  /* image filename */
     char *src_filename;  /* source filename on native FS */
     char *dst_path;      /* destination filename on image */
+    int recursive;       /* -r: src is a directory tree */
+    int n_readers;       /* -j: threads reading host files for -r */
+    int update;          /* --update: rewrite only changed blocks of dest */
+    int append;          /* --append: add src to the end of dest */
+
+    argc = parse_image_opts(argc, argv);
 
-    if (argc != 4) {
-        fprintf(stderr, "%s <image file name> <path to source file> <path to dest>\n", argv[0]);
+    if (argc < 4) {
+        fprintf(stderr, "%s <image file name> <path to source file> <path to dest> [-r] [-j readers] [--update | --append]\n", argv[0]);
         exit(EINVAL);
     }
 
     img_filename = argv[1];
     src_filename = argv[2];
     dst_path = argv[3];
+    recursive = 0;
+    update = append = 0;
+    n_readers = sysconf(_SC_NPROCESSORS_ONLN);
 
-    core_func(img_filename, src_filename, dst_path);
+    for (int i = 4; i < argc; ++i) {
+        if (!strcmp(argv[i], "-r")) {
+            recursive = 1;
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0) {
+            n_readers = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--update")) {
+            update = 1;
+        } else if (!strcmp(argv[i], "--append")) {
+            append = 1;
+        } else {
+            fprintf(stderr, "%s <image file name> <path to source file> <path to dest> [-r] [-j readers] [--update | --append]\n", argv[0]);
+            exit(EINVAL);
+        }
+    }
+
+    if (recursive + update + append > 1) {
+        fprintf(stderr, "-r, --update and --append are exclusive\n");
+        exit(EINVAL);
+    }
+
+    core_func(img_filename, src_filename, dst_path, recursive, n_readers, update,
+              append);
 
     return 0;
 }
-
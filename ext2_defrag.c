@@ -0,0 +1,35 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename, const char *path) {
+    if (path[0] != '/') {
+        fprintf(stderr, "invalid disk path found\n");
+        exit(EINVAL);
+    }
+    open_image(img_filename);
+    defrag_path(path);
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    char *path;          /* file or directory path on image */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "%s <image file name> [path]\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    path = argc == 3 ? argv[2] : "/";
+
+    core_func(img_filename, path);
+
+    return 0;
+}
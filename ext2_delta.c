@@ -0,0 +1,44 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename, int init, unsigned int since) {
+    int n_blocks;
+
+    open_image(img_filename);
+    if (init) {
+        init_change_map();
+    } else {
+        n_blocks = export_delta(since, stdout);
+        fprintf(stderr, "Exported %d changed blocks since generation %u\n",
+                n_blocks, since);
+    }
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc == 3 && !strcmp(argv[2], "--init")) {
+        core_func(argv[1], 1, 0);
+        return 0;
+    }
+
+    if (argc != 4 || strcmp(argv[2], "--since")) {
+        fprintf(stderr, "%s <image file name> --init | --since <generation>\n",
+                argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+
+    core_func(img_filename, 0, strtoul(argv[3], NULL, 10));
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+
+void core_func(const char *img_filename, const char *src_path, const char *dst_filename,
+               int recursive, int n_workers) {
+    if (src_path[0] != '/') {
+        fprintf(stderr, "invalid disk path found\n");
+        exit(EINVAL);
+    }
+    open_image(img_filename);
+    extract_path(src_path, dst_filename, recursive, n_workers);
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    char *src_path;      /* source path on image */
+    char *dst_filename;  /* destination on native FS */
+    int recursive;       /* -r: src_path may be a directory tree */
+    int n_workers;       /* -j: threads writing host files */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc < 4) {
+        fprintf(stderr, "%s <image file name> <path> <host dest> [-r] [-j workers]\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    src_path = argv[2];
+    dst_filename = argv[3];
+    recursive = 0;
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 4; i < argc; ++i) {
+        if (!strcmp(argv[i], "-r")) {
+            recursive = 1;
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0) {
+            n_workers = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "%s <image file name> <path> <host dest> [-r] [-j workers]\n", argv[0]);
+            exit(EINVAL);
+        }
+    }
+
+    core_func(img_filename, src_path, dst_filename, recursive, n_workers);
+
+    return 0;
+}
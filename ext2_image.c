@@ -0,0 +1,35 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename, const char *out_filename) {
+    int n_blocks;
+
+    open_image(img_filename);
+    n_blocks = capture_image(out_filename);
+    printf("Captured %d metadata blocks in %s\n", n_blocks, out_filename);
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    char *out_filename;  /* metadata-only copy to create */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc != 3) {
+        fprintf(stderr, "%s <image file name> <output image file name>\n",
+                argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    out_filename = argv[2];
+
+    core_func(img_filename, out_filename);
+
+    return 0;
+}
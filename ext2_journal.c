@@ -0,0 +1,435 @@
+#include "ext2_journal.h"
+#include "ext2.h"
+#include "ext2_blockio.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* tags that fit a descriptor block after its header and the one uuid */
+#define TAGS_PER_DESC                                                        \
+    ((EXT2_BLOCK_SIZE - sizeof(struct journal_header) - 16) /               \
+     sizeof(struct journal_block_tag))
+
+/* latest logged copy of one metadata block of the running transaction */
+struct log_record {
+    int n_block;
+    unsigned char data[EXT2_BLOCK_SIZE];
+};
+
+/* ------------------- running transaction ------------------- */
+void journal_hook(int stage);
+void add_to_txn();
+int count_txn_blocks(int num);
+void write_txn();
+void checkpoint_txn();
+void mark_journal(int n_start);
+/* ------------------- recovery ------------------- */
+int replay_journal();
+int replay_txn(int *pos, unsigned int tid);
+int next_log_pos(int pos);
+/* ------------------- log blocks ------------------- */
+void read_log(int pos, void *buf);
+void write_log(int pos, const void *buf);
+void init_header(struct journal_header *header, int type, unsigned int tid);
+int chk_header(const struct journal_header *header, int type,
+               unsigned int tid);
+
+static int *log_blocks = NULL; /* journal block -> image block */
+static int log_len = 0;
+static struct journal_superblock jsb;
+/* a clean mark written but not yet flushed: the log may not be reused */
+static int jsb_unsynced = 0;
+
+static struct log_record *txn = NULL;
+static int txn_num = 0;
+static int *txn_index = NULL; /* image block -> index in txn, or -1 */
+static int *txn_scratch = NULL;
+
+/* ----------- Public Functions ----------- */
+
+/* Write an empty journal superblock over the first of the given blocks. */
+void format_journal(const int *blocks, int num, const unsigned char *uuid) {
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    struct journal_superblock *new_jsb;
+
+    memset(buf, 0, sizeof(buf));
+    new_jsb = (struct journal_superblock *)buf;
+    init_header(&new_jsb->s_header, JBD2_SUPERBLOCK_V2, 0);
+    new_jsb->s_blocksize = htonl(EXT2_BLOCK_SIZE);
+    new_jsb->s_maxlen = htonl(num);
+    new_jsb->s_first = htonl(1);
+    new_jsb->s_sequence = htonl(1);
+    new_jsb->s_start = 0;
+    memcpy(new_jsb->s_uuid, uuid, 16);
+    new_jsb->s_nr_users = htonl(1);
+    memcpy(new_jsb->s_users, uuid, 16);
+
+    write_raw_block(blocks[0], buf);
+    memset(buf, 0, sizeof(buf));
+    for (int i = 1; i < num; ++i) {
+        write_raw_block(blocks[i], buf);
+    }
+    sync_raw_blocks();
+}
+
+/*
+ * Take over the journal stored in the given image blocks: replay the
+ * transactions a crash left behind, then log every later operation.
+ * Returns the number of transactions replayed.
+ */
+int open_journal(const int *blocks, int num) {
+    int n_replayed;
+
+    if (num < 1) {
+        fprintf(stderr, "journal has no blocks\n");
+        exit(EINVAL);
+    }
+    if (!(log_blocks = malloc(num * sizeof(int)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    memcpy(log_blocks, blocks, num * sizeof(int));
+
+    read_raw_block(log_blocks[0], &jsb);
+    if (jsb.s_header.h_magic != htonl(JBD2_MAGIC_NUMBER) ||
+        jsb.s_header.h_blocktype != htonl(JBD2_SUPERBLOCK_V2) ||
+        ntohl(jsb.s_blocksize) != EXT2_BLOCK_SIZE ||
+        ntohl(jsb.s_maxlen) > num || ntohl(jsb.s_first) < 1 ||
+        jsb.s_feature_incompat) {
+        fprintf(stderr, "journal superblock is invalid\n");
+        exit(EINVAL);
+    }
+    log_len = ntohl(jsb.s_maxlen);
+
+    n_replayed = replay_journal();
+
+    if (!(txn = malloc(log_len * sizeof(struct log_record))) ||
+        !(txn_index = malloc(count_blockio_blocks() * sizeof(int))) ||
+        !(txn_scratch = malloc(count_blockio_blocks() * sizeof(int)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    for (int i = 0; i < count_blockio_blocks(); ++i) {
+        txn_index[i] = -1;
+    }
+    txn_num = 0;
+
+    set_blockio_commit_hook(journal_hook);
+
+    return n_replayed;
+}
+
+void close_journal() {
+    set_blockio_commit_hook(NULL);
+    free(log_blocks);
+    free(txn);
+    free(txn_index);
+    free(txn_scratch);
+    log_blocks = NULL;
+    txn = NULL;
+    txn_index = txn_scratch = NULL;
+    log_len = txn_num = 0;
+    jsb_unsynced = 0;
+}
+
+/* ----------- Private Functions ----------- */
+
+/* ------------------- running transaction ------------------- */
+
+/*
+ * Every operation joins the running transaction (group commit); the
+ * transaction is logged as one sequential write once the block layer
+ * reaches a commit point.
+ */
+void journal_hook(int stage) {
+    if (stage == COMMIT_END_OP) {
+        add_to_txn();
+    } else if (stage == COMMIT_LOG) {
+        write_txn();
+    } else if (stage == COMMIT_DONE && txn_num) {
+        mark_journal(0);
+        for (int i = 0; i < txn_num; ++i) {
+            txn_index[txn[i].n_block] = -1;
+        }
+        txn_num = 0;
+    }
+}
+
+void add_to_txn() {
+    int num, n_new;
+    int n_block;
+
+    num = take_txn_blocks(txn_scratch);
+
+    n_new = 0;
+    for (int i = 0; i < num; ++i) {
+        if (txn_index[txn_scratch[i]] < 0) {
+            ++n_new;
+        }
+    }
+
+    /* no room next to the running transaction: commit it from its copies */
+    if (count_txn_blocks(txn_num + n_new) > log_len - 1 && txn_num) {
+        flush_class(BLOCK_DATA);
+        write_txn();
+        checkpoint_txn();
+        journal_hook(COMMIT_DONE);
+        n_new = num;
+    }
+    if (count_txn_blocks(txn_num + n_new) > log_len - 1) {
+        fprintf(stderr, "journal too small for one operation\n");
+        exit(ENOSPC);
+    }
+
+    for (int i = 0; i < num; ++i) {
+        n_block = txn_scratch[i];
+        if (txn_index[n_block] < 0) {
+            txn_index[n_block] = txn_num;
+            txn[txn_num++].n_block = n_block;
+        }
+        memcpy(txn[txn_index[n_block]].data, get_block(n_block, BLOCK_META),
+               EXT2_BLOCK_SIZE);
+    }
+}
+
+/* Journal blocks for num logged blocks: descriptors, copies, commit. */
+int count_txn_blocks(int num) {
+    return num + (num + TAGS_PER_DESC - 1) / TAGS_PER_DESC + 1;
+}
+
+/*
+ * Log the running transaction from s_first on. The commit block is only
+ * written once everything before it is stable, so a torn write can never
+ * look committed. The previous transaction's clean mark is made stable
+ * first: until then the on-disk superblock may still point recovery at
+ * s_first, where the old descriptor would tag the new copies.
+ */
+void write_txn() {
+    unsigned char desc[EXT2_BLOCK_SIZE];
+    unsigned char copy[EXT2_BLOCK_SIZE];
+    struct journal_block_tag *tag;
+    unsigned int tid;
+    int pos, n_desc_pos, n_tags;
+    int off;
+
+    /* blocks reused as data since they were logged are not replayed */
+    for (int i = 0; i < txn_num;) {
+        if (get_block_class(txn[i].n_block) != BLOCK_META) {
+            txn_index[txn[i].n_block] = -1;
+            txn[i] = txn[--txn_num];
+            txn_index[txn[i].n_block] = i < txn_num ? i : -1;
+        } else {
+            ++i;
+        }
+    }
+    if (!txn_num) {
+        return;
+    }
+
+    if (jsb_unsynced) {
+        sync_raw_blocks();
+        jsb_unsynced = 0;
+    }
+
+    tid = ntohl(jsb.s_sequence);
+    pos = ntohl(jsb.s_first);
+    n_desc_pos = 0;
+    n_tags = 0;
+    off = 0;
+    tag = NULL;
+
+    for (int i = 0; i < txn_num; ++i) {
+        if (n_tags == 0) {
+            memset(desc, 0, sizeof(desc));
+            init_header((struct journal_header *)desc, JBD2_DESCRIPTOR_BLOCK,
+                        tid);
+            n_desc_pos = pos;
+            pos = next_log_pos(pos);
+            off = sizeof(struct journal_header);
+        }
+
+        tag = (struct journal_block_tag *)(desc + off);
+        tag->t_blocknr = htonl(txn[i].n_block);
+        tag->t_flags = n_tags ? htons(JBD2_FLAG_SAME_UUID) : 0;
+        off += sizeof(struct journal_block_tag);
+        if (!n_tags) {
+            memcpy(desc + off, jsb.s_uuid, 16);
+            off += 16;
+        }
+
+        memcpy(copy, txn[i].data, EXT2_BLOCK_SIZE);
+        if (*(unsigned int *)copy == htonl(JBD2_MAGIC_NUMBER)) {
+            *(unsigned int *)copy = 0;
+            tag->t_flags |= htons(JBD2_FLAG_ESCAPE);
+        }
+        write_log(pos, copy);
+        pos = next_log_pos(pos);
+
+        if (++n_tags == TAGS_PER_DESC || i == txn_num - 1) {
+            tag->t_flags |= htons(JBD2_FLAG_LAST_TAG);
+            write_log(n_desc_pos, desc);
+            n_tags = 0;
+        }
+    }
+    sync_raw_blocks();
+
+    memset(desc, 0, sizeof(desc));
+    init_header((struct journal_header *)desc, JBD2_COMMIT_BLOCK, tid);
+    write_log(pos, desc);
+    mark_journal(ntohl(jsb.s_first));
+    sync_raw_blocks();
+}
+
+void checkpoint_txn() {
+    for (int i = 0; i < txn_num; ++i) {
+        write_raw_block(txn[i].n_block, txn[i].data);
+    }
+    sync_raw_blocks();
+}
+
+/*
+ * Point the journal superblock at the log (n_start) or mark it clean
+ * (0) and move on to the next transaction ID. The clean mark is not
+ * flushed here: replaying a checkpointed transaction is harmless as long
+ * as its log is intact, and write_txn() flushes the mark before it
+ * overwrites that log.
+ */
+void mark_journal(int n_start) {
+    if (!n_start) {
+        jsb.s_sequence = htonl(ntohl(jsb.s_sequence) + 1);
+    }
+    jsb.s_start = htonl(n_start);
+    write_log(0, &jsb);
+    jsb_unsynced = !n_start;
+}
+
+/* ------------------- recovery ------------------- */
+
+int replay_journal() {
+    unsigned int tid;
+    int pos;
+    int n_replayed;
+
+    if (!jsb.s_start) {
+        return 0;
+    }
+
+    tid = ntohl(jsb.s_sequence);
+    pos = ntohl(jsb.s_start);
+    n_replayed = 0;
+    while (replay_txn(&pos, tid)) {
+        ++tid;
+        ++n_replayed;
+    }
+    sync_raw_blocks();
+
+    jsb.s_sequence = htonl(tid);
+    jsb.s_start = 0;
+    write_log(0, &jsb);
+    sync_raw_blocks();
+
+    invalidate_blocks();
+
+    return n_replayed;
+}
+
+/*
+ * Apply one transaction starting at *pos if its commit block made it to
+ * the log. Returns 0 at the end of the log.
+ */
+int replay_txn(int *pos, unsigned int tid) {
+    unsigned char desc[EXT2_BLOCK_SIZE];
+    unsigned char copy[EXT2_BLOCK_SIZE];
+    struct journal_block_tag *tag;
+    int p, off, flags;
+    int n_steps;
+
+    /* first pass: find the commit block */
+    p = *pos;
+    for (n_steps = 0;; ++n_steps) {
+        if (n_steps >= log_len) {
+            return 0;
+        }
+        read_log(p, desc);
+        if (chk_header((struct journal_header *)desc, JBD2_COMMIT_BLOCK, tid)) {
+            break;
+        }
+        if (!chk_header((struct journal_header *)desc, JBD2_DESCRIPTOR_BLOCK,
+                        tid)) {
+            return 0;
+        }
+        off = sizeof(struct journal_header);
+        do {
+            tag = (struct journal_block_tag *)(desc + off);
+            flags = ntohs(tag->t_flags);
+            off += sizeof(struct journal_block_tag);
+            if (!(flags & JBD2_FLAG_SAME_UUID)) {
+                off += 16;
+            }
+            p = next_log_pos(p);
+        } while (!(flags & JBD2_FLAG_LAST_TAG) &&
+                 off + sizeof(struct journal_block_tag) <= EXT2_BLOCK_SIZE);
+        p = next_log_pos(p);
+    }
+
+    /* second pass: copy the logged blocks home */
+    p = *pos;
+    for (;;) {
+        read_log(p, desc);
+        if (chk_header((struct journal_header *)desc, JBD2_COMMIT_BLOCK, tid)) {
+            break;
+        }
+        off = sizeof(struct journal_header);
+        do {
+            tag = (struct journal_block_tag *)(desc + off);
+            flags = ntohs(tag->t_flags);
+            off += sizeof(struct journal_block_tag);
+            if (!(flags & JBD2_FLAG_SAME_UUID)) {
+                off += 16;
+            }
+            p = next_log_pos(p);
+            read_log(p, copy);
+            if (flags & JBD2_FLAG_ESCAPE) {
+                *(unsigned int *)copy = htonl(JBD2_MAGIC_NUMBER);
+            }
+            if (ntohl(tag->t_blocknr) < count_blockio_blocks()) {
+                write_raw_block(ntohl(tag->t_blocknr), copy);
+            }
+        } while (!(flags & JBD2_FLAG_LAST_TAG) &&
+                 off + sizeof(struct journal_block_tag) <= EXT2_BLOCK_SIZE);
+        p = next_log_pos(p);
+    }
+
+    *pos = next_log_pos(p);
+
+    return 1;
+}
+
+/* The log is circular between s_first and s_maxlen. */
+int next_log_pos(int pos) {
+    return pos + 1 < log_len ? pos + 1 : (int)ntohl(jsb.s_first);
+}
+
+/* ------------------- log blocks ------------------- */
+
+void read_log(int pos, void *buf) { read_raw_block(log_blocks[pos], buf); }
+
+void write_log(int pos, const void *buf) {
+    write_raw_block(log_blocks[pos], buf);
+}
+
+void init_header(struct journal_header *header, int type, unsigned int tid) {
+    header->h_magic = htonl(JBD2_MAGIC_NUMBER);
+    header->h_blocktype = htonl(type);
+    header->h_sequence = htonl(tid);
+}
+
+int chk_header(const struct journal_header *header, int type,
+               unsigned int tid) {
+    return header->h_magic == htonl(JBD2_MAGIC_NUMBER) &&
+           header->h_blocktype == htonl(type) &&
+           header->h_sequence == htonl(tid);
+}
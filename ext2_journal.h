@@ -0,0 +1,58 @@
+#ifndef _EXT2_JOURNAL_
+#define _EXT2_JOURNAL_
+
+/*
+ * A metadata journal in the on-disk format of ext3/jbd2 (v2 superblock,
+ * no checksums, 32-bit block numbers), kept in the blocks of a reserved
+ * inode. All fields are big-endian.
+ */
+#define JBD2_MAGIC_NUMBER 0xC03B3998U
+
+#define JBD2_DESCRIPTOR_BLOCK 1
+#define JBD2_COMMIT_BLOCK     2
+#define JBD2_SUPERBLOCK_V2    4
+
+#define JBD2_FLAG_ESCAPE    1  /* logged block began with the magic */
+#define JBD2_FLAG_SAME_UUID 2  /* no uuid follows this tag */
+#define JBD2_FLAG_LAST_TAG  8
+
+struct journal_header {
+    unsigned int h_magic;
+    unsigned int h_blocktype;
+    unsigned int h_sequence;
+};
+
+struct journal_superblock {
+    struct journal_header s_header;
+    unsigned int s_blocksize;  /* journal device blocksize */
+    unsigned int s_maxlen;     /* total blocks in journal file */
+    unsigned int s_first;      /* first block of log information */
+    unsigned int s_sequence;   /* first commit ID expected in log */
+    unsigned int s_start;      /* block of start of log, 0 if clean */
+    unsigned int s_errno;
+    unsigned int s_feature_compat;
+    unsigned int s_feature_incompat;
+    unsigned int s_feature_ro_compat;
+    unsigned char s_uuid[16];
+    unsigned int s_nr_users;
+    unsigned int s_dynsuper;
+    unsigned int s_max_transaction;
+    unsigned int s_max_trans_data;
+    unsigned char s_checksum_type;
+    unsigned char s_padding2[3];
+    unsigned int s_padding[42];
+    unsigned int s_checksum;
+    unsigned char s_users[16 * 48];
+};
+
+struct journal_block_tag {
+    unsigned int t_blocknr;
+    unsigned short t_checksum;
+    unsigned short t_flags;
+};
+
+void format_journal(const int *blocks, int num, const unsigned char *uuid);
+int open_journal(const int *blocks, int num);
+void close_journal();
+
+#endif /* _EXT2_JOURNAL_ */
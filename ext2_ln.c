@@ -25,6 +25,8 @@ int main(int argc, char **argv) {
     char *src_path;      /* source path on image */
     char *dst_path;      /* destination path on image */
 
+    argc = parse_image_opts(argc, argv);
+
     if (argc != 4 && argc != 5) {
         fprintf(stderr, "%s <image file name> [-s] <source path> <dest path>\n", argv[0]);
         exit(EINVAL);
@@ -0,0 +1,81 @@
+#include "ext2_utils.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define DEFAULT_INODE_RATIO 8192
+
+
+/* <number>[K|M|G|T] in blocks; a bare number counts KiB, as for mke2fs */
+long long parse_size(const char *arg) {
+    char *end;
+    long long size;
+
+    size = strtoll(arg, &end, 10);
+    switch (*end) {
+    case 'T': case 't': size *= 1024;  /* fall through */
+    case 'G': case 'g': size *= 1024;  /* fall through */
+    case 'M': case 'm': size *= 1024;  /* fall through */
+    case 'K': case 'k': ++end;         /* fall through */
+    case '\0': break;
+    default: size = -1;
+    }
+    if (*end || size <= 0) {
+        fprintf(stderr, "invalid size: %s\n", arg);
+        exit(EINVAL);
+    }
+    return size * 1024 / EXT2_BLOCK_SIZE;
+}
+
+void core_func(const char *img_filename, long long n_blocks,
+               int inode_ratio) {
+    if (n_blocks > INT_MAX) {
+        fprintf(stderr, "image of %lld blocks is too large\n", n_blocks);
+        exit(EFBIG);
+    }
+    make_image(img_filename, n_blocks, inode_ratio);
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    long long n_blocks;
+    int inode_ratio = DEFAULT_INODE_RATIO;
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc < 3 || argc % 2 == 0) {
+        fprintf(stderr, "%s <image file name> <size>[K|M|G|T] "
+                "[-b blocksize] [-i bytes-per-inode]\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    for (int i = 3; i < argc; i += 2) {
+        if (!strcmp(argv[i], "-b")) {
+            if (atoi(argv[i + 1]) != EXT2_BLOCK_SIZE) {
+                fprintf(stderr, "only %d-byte blocks are supported\n",
+                        EXT2_BLOCK_SIZE);
+                exit(EINVAL);
+            }
+        } else if (!strcmp(argv[i], "-i")) {
+            inode_ratio = atoi(argv[i + 1]);
+            if (inode_ratio < EXT2_BLOCK_SIZE) {
+                fprintf(stderr, "bytes-per-inode must be at least %d\n",
+                        EXT2_BLOCK_SIZE);
+                exit(EINVAL);
+            }
+        } else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            exit(EINVAL);
+        }
+    }
+
+    img_filename = argv[1];
+    n_blocks = parse_size(argv[2]);
+
+    core_func(img_filename, n_blocks, inode_ratio);
+
+    return 0;
+}
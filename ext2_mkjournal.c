@@ -0,0 +1,33 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define DEFAULT_JOURNAL_BLOCKS 1024
+
+
+void core_func(const char *img_filename, int n_blocks) {
+    open_image(img_filename);
+    create_journal(n_blocks);
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    int n_blocks;        /* journal size in blocks */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "%s <image file name> [journal blocks]\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    n_blocks = argc == 3 ? atoi(argv[2]) : DEFAULT_JOURNAL_BLOCKS;
+
+    core_func(img_filename, n_blocks);
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename, const char *src_path, const char *dst_path) {
+    if (src_path[0] != '/' || dst_path[0] != '/') {
+        fprintf(stderr, "invalid disk path found\n");
+        exit(EINVAL);
+    }
+    if (!strcmp(src_path, dst_path)) {
+        fprintf(stderr, "identical paths found\n");
+        exit(EINVAL);
+    }
+    open_image(img_filename);
+    move_path(src_path, dst_path);
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    char *src_path;      /* source path on image */
+    char *dst_path;      /* new path, or directory to move into */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc != 4) {
+        fprintf(stderr, "%s <image file name> <source path> <dest path>\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    src_path = argv[2];
+    dst_path = argv[3];
+
+    core_func(img_filename, src_path, dst_path);
+
+    return 0;
+}
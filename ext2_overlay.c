@@ -0,0 +1,43 @@
+#include "ext2_blockio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+
+void core_func(const char *img_filename, const char *delta_filename,
+               const char *action) {
+    if (!strcmp(action, "merge")) {
+        printf("Merged %d blocks into %s\n",
+               merge_overlay(img_filename, delta_filename), img_filename);
+    } else if (!strcmp(action, "discard")) {
+        if (unlink(delta_filename) != 0) {
+            perror(delta_filename);
+            exit(ENOENT);
+        }
+        printf("Discarded %s\n", delta_filename);
+    } else {
+        fprintf(stderr, "unknown action %s\n", action);
+        exit(EINVAL);
+    }
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;    /* base image filename */
+    char *delta_filename;  /* overlay delta filename */
+
+    if (argc != 4) {
+        fprintf(stderr, "%s <image file name> <delta file name> merge|discard\n",
+                argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    delta_filename = argv[2];
+
+    core_func(img_filename, delta_filename, argv[3]);
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "ext2_pathtokens.h"
+#include "ext2_stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,7 @@ struct path_tokens *create_path_tokens(const char *path) {
     char **tokens;
     struct path_tokens *pt;
 
+    STAT_INC(path_allocs);
     if (!(path_dup = strdup(path))) {
         perror("malloc");
         exit(ENOMEM);
@@ -19,6 +19,8 @@ int main(int argc, char **argv) {
     char *img_filename;  /* image filename */
     char *dst_path;      /* directory path on image */
 
+    argc = parse_image_opts(argc, argv);
+
     if (argc != 3) {
         fprintf(stderr, "%s <image file name> <path to file>\n", argv[0]);
         exit(EINVAL);
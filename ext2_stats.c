@@ -0,0 +1,83 @@
+#include "ext2_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+struct ext2_counters ext2_counters;
+
+static const char *phase_names[NUM_PHASES] = {"open", "run", "close"};
+
+/* start of each phase, 0 for one not entered yet */
+static double phase_start[NUM_PHASES];
+static struct rusage stats_start;
+
+double stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ------------------- public ------------------- */
+
+/* Zero the counters and enter PHASE_OPEN. */
+void start_stats() {
+    memset(&ext2_counters, 0, sizeof(ext2_counters));
+    memset(phase_start, 0, sizeof(phase_start));
+    getrusage(RUSAGE_SELF, &stats_start);
+    phase_start[PHASE_OPEN] = stats_now();
+}
+
+void enter_stats_phase(int phase) { phase_start[phase] = stats_now(); }
+
+/* Counters, page faults and phase times since start_stats(), to stderr. */
+void print_stats(int format) {
+    struct rusage now;
+    double end, ms[NUM_PHASES];
+    struct ext2_counters *c = &ext2_counters;
+
+    end = stats_now();
+    getrusage(RUSAGE_SELF, &now);
+    for (int i = NUM_PHASES - 1; i >= 0; --i) {
+        ms[i] = phase_start[i] ? (end - phase_start[i]) * 1e3 : 0;
+        if (phase_start[i]) {
+            end = phase_start[i];
+        }
+    }
+
+    if (format == STATS_JSON) {
+        fprintf(stderr,
+                "{\"minor_faults\": %ld, \"major_faults\": %ld, "
+                "\"bits_scanned\": %lu, \"dents_visited\": %lu, "
+                "\"blocks_mapped\": %lu, \"paths_resolved\": %lu, "
+                "\"path_allocs\": %lu, \"bytes_copied\": %lu",
+                now.ru_minflt - stats_start.ru_minflt,
+                now.ru_majflt - stats_start.ru_majflt, c->bits_scanned,
+                c->dents_visited, c->blocks_mapped, c->paths_resolved,
+                c->path_allocs, c->bytes_copied);
+        for (int i = 0; i < NUM_PHASES; ++i) {
+            fprintf(stderr, ", \"%s_ms\": %.3f", phase_names[i], ms[i]);
+        }
+        fprintf(stderr, "}\n");
+        return;
+    }
+
+    fprintf(stderr, "stats: %ld minor faults, %ld major faults\n",
+            now.ru_minflt - stats_start.ru_minflt,
+            now.ru_majflt - stats_start.ru_majflt);
+#ifndef EXT2_NO_STATS
+    fprintf(stderr,
+            "stats: %lu bitmap bits scanned, %lu dirents visited, "
+            "%lu blocks mapped\n"
+            "stats: %lu paths resolved, %lu path_tokens allocated, "
+            "%lu bytes copied\n",
+            c->bits_scanned, c->dents_visited, c->blocks_mapped,
+            c->paths_resolved, c->path_allocs, c->bytes_copied);
+#endif
+    fprintf(stderr, "stats:");
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        fprintf(stderr, " %s %.3f ms%s", phase_names[i], ms[i],
+                i < NUM_PHASES - 1 ? "," : "\n");
+    }
+}
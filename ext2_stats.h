@@ -0,0 +1,42 @@
+#ifndef _EXT2_STATS_
+#define _EXT2_STATS_
+
+/*
+ * Counters on the hot paths, printed by --stats. Build with
+ * -DEXT2_NO_STATS (make EXTRA_CFLAGS=-DEXT2_NO_STATS) to compile the
+ * updates out; the phase times and page faults are still reported.
+ */
+#ifndef EXT2_NO_STATS
+#define STAT_ADD(counter, n) (ext2_counters.counter += (n))
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+
+struct ext2_counters {
+    unsigned long bits_scanned;   /* bitmap bits looked at for free ones */
+    unsigned long dents_visited;  /* directory entries walked */
+    unsigned long blocks_mapped;  /* file index to block lookups */
+    unsigned long paths_resolved; /* path walks from root or the cache */
+    unsigned long path_allocs;    /* path_tokens built */
+    unsigned long bytes_copied;   /* file data and raw blocks moved */
+};
+
+extern struct ext2_counters ext2_counters;
+
+/* output formats */
+#define STATS_OFF  0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* phases of a session, each timed from its start to the next one's */
+#define PHASE_OPEN  0  /* open_image(): mapping, pinning, journal replay */
+#define PHASE_RUN   1  /* the tool's operation */
+#define PHASE_CLOSE 2  /* close_image(): flush, sync, change map */
+#define NUM_PHASES  3
+
+void start_stats();
+void enter_stats_phase(int phase);
+void print_stats(int format);
+
+#endif /* _EXT2_STATS_ */
@@ -0,0 +1,200 @@
+#include "ext2_stream.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+void *stream_writer(void *arg);
+void *stream_reader(void *arg);
+void hand_over(struct stream *st);
+
+/* ------------------- public ------------------- */
+
+struct stream *open_stream(FILE *fp, int mode) {
+    struct stream *st;
+    int err;
+
+    if (!(st = calloc(1, sizeof(struct stream)))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (!(st->bufs[i].data = malloc(STREAM_BUF_SIZE))) {
+            perror("malloc");
+            exit(ENOMEM);
+        }
+    }
+    st->fp = fp;
+    st->mode = mode;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+
+    if ((err = pthread_create(&st->thread, NULL,
+                              mode == STREAM_OUT ? stream_writer
+                                                 : stream_reader,
+                              st))) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(err);
+    }
+    return st;
+}
+
+void stream_put(struct stream *st, const void *buf, size_t len) {
+    struct stream_buffer *b;
+    size_t n;
+
+    while (len > 0) {
+        b = &st->bufs[st->cur];
+        n = MIN(len, STREAM_BUF_SIZE - b->len);
+        memcpy(b->data + b->len, buf, n);
+        b->len += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        if (b->len == STREAM_BUF_SIZE) {
+            hand_over(st);
+        }
+    }
+}
+
+void stream_get(struct stream *st, void *buf, size_t len) {
+    struct stream_buffer *b;
+    size_t n;
+
+    while (len > 0) {
+        b = &st->bufs[st->cur];
+        pthread_mutex_lock(&st->lock);
+        while (!b->ready && !st->done) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        pthread_mutex_unlock(&st->lock);
+        if (!b->ready) {
+            fprintf(stderr, "truncated stream\n");
+            exit(EINVAL);
+        }
+        n = MIN(len, b->len - b->pos);
+        memcpy(buf, b->data + b->pos, n);
+        b->pos += n;
+        buf = (char *)buf + n;
+        len -= n;
+        if (b->pos == b->len) {
+            hand_over(st);
+        }
+    }
+}
+
+/* Write out what is buffered, or stop reading ahead, and free st. */
+void close_stream(struct stream *st) {
+    pthread_mutex_lock(&st->lock);
+    if (st->mode == STREAM_OUT && st->bufs[st->cur].len > 0) {
+        st->bufs[st->cur].ready = 1;
+    }
+    st->done = 1;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    pthread_join(st->thread, NULL);
+
+    if (st->mode == STREAM_OUT && fflush(st->fp) != 0) {
+        perror("fflush");
+        exit(EIO);
+    }
+
+    pthread_cond_destroy(&st->cond);
+    pthread_mutex_destroy(&st->lock);
+    free(st->bufs[0].data);
+    free(st->bufs[1].data);
+    free(st);
+}
+
+/* ------------------- helpers ------------------- */
+
+/*
+ * Give the current buffer to the thread (full for STREAM_OUT, drained
+ * for STREAM_IN) and wait until the other one is the caller's again.
+ */
+void hand_over(struct stream *st) {
+    struct stream_buffer *next;
+
+    pthread_mutex_lock(&st->lock);
+    st->bufs[st->cur].ready = st->mode == STREAM_OUT;
+    pthread_cond_broadcast(&st->cond);
+    st->cur ^= 1;
+    next = &st->bufs[st->cur];
+    if (st->mode == STREAM_OUT) {
+        while (next->ready) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+void *stream_writer(void *arg) {
+    struct stream *st = arg;
+    struct stream_buffer *b;
+
+    for (int i = 0;; i ^= 1) {
+        b = &st->bufs[i];
+        pthread_mutex_lock(&st->lock);
+        while (!b->ready && !st->done) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        pthread_mutex_unlock(&st->lock);
+        if (!b->ready) {
+            break;
+        }
+
+        if (fwrite(b->data, 1, b->len, st->fp) != b->len) {
+            perror("fwrite");
+            exit(EIO);
+        }
+
+        pthread_mutex_lock(&st->lock);
+        b->len = 0;
+        b->ready = 0;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+    return NULL;
+}
+
+void *stream_reader(void *arg) {
+    struct stream *st = arg;
+    struct stream_buffer *b;
+    size_t n;
+    int done;
+
+    for (int i = 0;; i ^= 1) {
+        b = &st->bufs[i];
+        pthread_mutex_lock(&st->lock);
+        while (b->ready && !st->done) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        done = st->done;
+        pthread_mutex_unlock(&st->lock);
+        if (done) {
+            break;
+        }
+
+        n = fread(b->data, 1, STREAM_BUF_SIZE, st->fp);
+        if (ferror(st->fp)) {
+            perror("fread");
+            exit(EIO);
+        }
+
+        pthread_mutex_lock(&st->lock);
+        b->len = n;
+        b->pos = 0;
+        b->ready = 1;
+        if (n < STREAM_BUF_SIZE) {
+            st->done = 1;
+        }
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+        if (n < STREAM_BUF_SIZE) {
+            break;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef _EXT2_STREAM_
+#define _EXT2_STREAM_
+
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * A double-buffered stream: a thread moves one buffer to or from the
+ * FILE while the caller fills or drains the other, so reading the image
+ * and writing the stream (or the reverse) overlap.
+ */
+#define STREAM_BUF_SIZE (1024 * 1024)
+
+#define STREAM_OUT 0  /* stream_put(), buffers written by the thread */
+#define STREAM_IN  1  /* stream_get(), buffers read ahead by the thread */
+
+struct stream_buffer {
+    char *data;
+    size_t len;  /* bytes filled */
+    size_t pos;  /* bytes the caller has taken, for STREAM_IN */
+    int ready;   /* handed over: to the thread (OUT) or to the caller (IN) */
+};
+
+struct stream {
+    FILE *fp;
+    int mode;
+    int cur;     /* buffer the caller works on */
+    int done;    /* no buffer is handed over after the ready ones */
+    struct stream_buffer bufs[2];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct stream *open_stream(FILE *fp, int mode);
+void stream_put(struct stream *st, const void *buf, size_t len);
+void stream_get(struct stream *st, void *buf, size_t len);
+void close_stream(struct stream *st);
+
+#endif /* _EXT2_STREAM_ */
@@ -0,0 +1,46 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename, int import, const char *path) {
+    if (path[0] != '/') {
+        fprintf(stderr, "invalid disk path found\n");
+        exit(EINVAL);
+    }
+    open_image(img_filename);
+    if (import) {
+        import_tar(stdin, path);
+    } else {
+        export_tar(path, stdout);
+    }
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    int import;          /* --import: archive on stdin into the image */
+    char *path;          /* directory to import under, or path to export */
+
+    argc = parse_image_opts(argc, argv);
+
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "--import")) {
+        import = 1;
+        path = argc == 4 ? argv[3] : "/";
+    } else if (argc == 4 && !strcmp(argv[1], "--export")) {
+        import = 0;
+        path = argv[3];
+    } else {
+        fprintf(stderr, "%s --import <image file name> [<dir>] < <archive> | --export <image file name> <path> > <archive>\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[2];
+
+    core_func(img_filename, import, path);
+
+    return 0;
+}
@@ -0,0 +1,217 @@
+#include "ext2_trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef EXT2_TRACE
+
+void set_trace_output(const char *filename) {
+    fprintf(stderr, "--trace needs a build with -DEXT2_TRACE\n");
+    exit(EINVAL);
+}
+
+#else
+
+/*
+ * HDR-style histogram: exact below HIST_SUB ns, then HIST_SUB linear
+ * buckets per power of two, so every bucket is within 1/HIST_SUB of the
+ * values it holds.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* events kept for the Chrome trace, later ones are only counted */
+#define MAX_TRACE_EVENTS (1 << 20)
+
+struct trace_hist {
+    unsigned long count;
+    unsigned long long sum, max;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+struct trace_event {
+    int span;
+    unsigned long long start, dur;
+};
+
+static const char *span_names[NUM_TRACE_SPANS] = {
+    "mkdir",   "cp",    "ln",   "rm",  "restore", "mv",
+    "resolve", "alloc", "dent", "copy"};
+
+static struct trace_hist hists[NUM_TRACE_SPANS];
+
+/* --trace=<file>: Chrome trace-event JSON written at exit */
+static char *trace_filename = NULL;
+static struct trace_event *events = NULL;
+static int num_events = 0, max_events = 0;
+static unsigned long dropped_events = 0;
+
+void print_trace_hists();
+void write_trace_events();
+void flush_trace();
+
+/* ------------------- public ------------------- */
+
+/* Start tracing; filename, if given, receives the trace events. */
+void set_trace_output(const char *filename) {
+    static int registered = 0;
+
+    if (filename) {
+        free(trace_filename);
+        if (!(trace_filename = strdup(filename))) {
+            perror("strdup");
+            exit(ENOMEM);
+        }
+    }
+    if (!registered) {
+        atexit(flush_trace);
+        registered = 1;
+    }
+}
+
+unsigned long long trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_record(int span, unsigned long long start) {
+    unsigned long long dur;
+    struct trace_hist *h;
+    int b, e;
+
+    dur = trace_now() - start;
+
+    h = &hists[span];
+    if (dur < HIST_SUB) {
+        b = dur;
+    } else {
+        e = 63 - __builtin_clzll(dur);
+        b = (e - HIST_SUB_BITS + 1) * HIST_SUB +
+            (dur >> (e - HIST_SUB_BITS)) - HIST_SUB;
+    }
+    ++h->buckets[b];
+    ++h->count;
+    h->sum += dur;
+    if (dur > h->max) {
+        h->max = dur;
+    }
+
+    if (!trace_filename) {
+        return;
+    }
+    if (num_events == max_events) {
+        if (max_events == MAX_TRACE_EVENTS) {
+            ++dropped_events;
+            return;
+        }
+        max_events = max_events ? max_events * 2 : 4096;
+        if (!(events = realloc(events,
+                               max_events * sizeof(struct trace_event)))) {
+            perror("realloc");
+            exit(ENOMEM);
+        }
+    }
+    events[num_events].span = span;
+    events[num_events].start = start;
+    events[num_events].dur = dur;
+    ++num_events;
+}
+
+/* ------------------- helpers ------------------- */
+
+/* Largest value bucket b holds. */
+unsigned long long hist_value(int b) {
+    int e;
+
+    if (b < HIST_SUB) {
+        return b;
+    }
+    e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((unsigned long long)(b % HIST_SUB + HIST_SUB + 1)
+            << (e - HIST_SUB_BITS)) - 1;
+}
+
+double hist_percentile(const struct trace_hist *h, double q) {
+    unsigned long rank, seen;
+
+    rank = (unsigned long)(q * h->count + 0.999999);
+    seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        if ((seen += h->buckets[b]) >= rank) {
+            return hist_value(b) < h->max ? hist_value(b) : h->max;
+        }
+    }
+    return h->max;
+}
+
+void flush_trace() {
+    print_trace_hists();
+    if (trace_filename) {
+        write_trace_events();
+    }
+}
+
+void print_trace_hists() {
+    struct trace_hist *h;
+
+    fprintf(stderr, "trace: %-8s %8s %10s %10s %10s %10s %10s (us)\n",
+            "span", "count", "mean", "p50", "p90", "p99", "max");
+    for (int i = 0; i < NUM_TRACE_SPANS; ++i) {
+        h = &hists[i];
+        if (!h->count) {
+            continue;
+        }
+        fprintf(stderr,
+                "trace: %-8s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                span_names[i], h->count, h->sum / 1e3 / h->count,
+                hist_percentile(h, 0.50) / 1e3,
+                hist_percentile(h, 0.90) / 1e3,
+                hist_percentile(h, 0.99) / 1e3, h->max / 1e3);
+    }
+    if (dropped_events) {
+        fprintf(stderr, "trace: %lu events past the first %d not written\n",
+                dropped_events, MAX_TRACE_EVENTS);
+    }
+}
+
+/* Complete ("X") events, microseconds from the first traced span. */
+void write_trace_events() {
+    FILE *fp;
+    unsigned long long origin;
+    int pid;
+
+    if (!(fp = fopen(trace_filename, "w"))) {
+        perror(trace_filename);
+        return;
+    }
+    origin = num_events ? events[0].start : 0;
+    for (int i = 1; i < num_events; ++i) {
+        if (events[i].start < origin) {
+            origin = events[i].start;
+        }
+    }
+    pid = getpid();
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (int i = 0; i < num_events; ++i) {
+        fprintf(fp,
+                "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+                i ? "," : "", span_names[events[i].span],
+                events[i].span < TRACE_RESOLVE ? "op" : "phase",
+                (events[i].start - origin) / 1e3, events[i].dur / 1e3, pid,
+                pid);
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0) {
+        perror(trace_filename);
+    }
+}
+
+#endif /* EXT2_TRACE */
@@ -0,0 +1,39 @@
+#ifndef _EXT2_TRACE_
+#define _EXT2_TRACE_
+
+/*
+ * Latency tracing of operations and their sub-phases, built only with
+ * -DEXT2_TRACE (make EXTRA_CFLAGS=-DEXT2_TRACE). Otherwise the macros
+ * below expand to nothing and --trace is refused.
+ *
+ * TRACE_BEGIN(span) and TRACE_END(span) bracket one span in a function;
+ * an early exit between them simply drops the sample. Spans nest. Not
+ * thread-safe: only the thread driving the library may trace.
+ */
+#ifdef EXT2_TRACE
+#define TRACE_BEGIN(span) unsigned long long _trace_##span = trace_now()
+#define TRACE_END(span) trace_record(span, _trace_##span)
+#else
+#define TRACE_BEGIN(span)
+#define TRACE_END(span)
+#endif
+
+/* operations */
+#define TRACE_MKDIR   0
+#define TRACE_CP      1
+#define TRACE_LN      2
+#define TRACE_RM      3
+#define TRACE_RESTORE 4
+#define TRACE_MV      5
+/* sub-phases */
+#define TRACE_RESOLVE 6  /* resolve_path() */
+#define TRACE_ALLOC   7  /* alloc_block(), alloc_inode() */
+#define TRACE_DENT    8  /* add_dent() */
+#define TRACE_COPY    9  /* file data into blocks */
+#define NUM_TRACE_SPANS 10
+
+void set_trace_output(const char *filename);
+unsigned long long trace_now();
+void trace_record(int span, unsigned long long start);
+
+#endif /* _EXT2_TRACE_ */
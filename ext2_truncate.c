@@ -0,0 +1,58 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+/* <number>[K|M|G] in bytes */
+long parse_size(const char *arg) {
+    char *end;
+    long size;
+
+    size = strtol(arg, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size *= 1024;  /* fall through */
+    case 'M': case 'm': size *= 1024;  /* fall through */
+    case 'K': case 'k': size *= 1024; ++end;  /* fall through */
+    case '\0': break;
+    default: size = -1;
+    }
+    if (*end || size < 0) {
+        fprintf(stderr, "invalid size: %s\n", arg);
+        exit(EINVAL);
+    }
+    return size;
+}
+
+void core_func(const char *img_filename, const char *path, long size) {
+    if (path[0] != '/') {
+        fprintf(stderr, "invalid disk path found\n");
+        exit(EINVAL);
+    }
+    open_image(img_filename);
+    truncate_reg(path, size);
+    close_image();
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+    char *path;          /* file path on image */
+    long size;           /* new size in bytes */
+
+    argc = parse_image_opts(argc, argv);
+
+    if (argc != 4) {
+        fprintf(stderr, "%s <image file name> <path> <size>[K|M|G]\n", argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+    path = argv[2];
+    size = parse_size(argv[3]);
+
+    core_func(img_filename, path, size);
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include "ext2_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+void core_func(const char *img_filename) {
+    printf("Unpacked %d blocks\n", unpack_image(img_filename, stdin));
+}
+
+int main(int argc, char **argv) {
+    char *img_filename;  /* image filename */
+
+    if (argc != 2) {
+        fprintf(stderr, "%s <new image file name> < <packed stream>\n",
+                argv[0]);
+        exit(EINVAL);
+    }
+
+    img_filename = argv[1];
+
+    core_func(img_filename);
+
+    return 0;
+}
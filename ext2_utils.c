@@ -1,13 +1,23 @@
+#define _GNU_SOURCE
+
 #include "ext2_utils.h"
+#include "ext2_blockio.h"
+#include "ext2_journal.h"
 #include "ext2_pathtokens.h"
+#include "ext2_stats.h"
+#include "ext2_stream.h"
+#include "ext2_trace.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -17,13 +27,59 @@
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define ABS(x) ((x > 0) ? (x) : (-x))
 
+#define MAX_SYMLINK_DEPTH 8
+#define PATH_CACHE_SIZE 256
+#define DIR_GAPS_CACHE_SIZE 64
+/* jbd2's own floor, e2fsck rejects smaller journals */
+#define JOURNAL_MIN_BLOCKS 1024
+/* direct, indirect and double-indirect blocks of the journal inode */
+#define JOURNAL_MAX_BLOCKS                                                   \
+    (12 + EXT2_BLOCK_SIZE / 4 + (EXT2_BLOCK_SIZE / 4) * (EXT2_BLOCK_SIZE / 4))
+#define MKFS_MIN_BLOCKS 64
+#define LOST_FOUND_BLOCKS 12
+
+/*
+ * generation of the last session that changed the image, kept in a
+ * word (offset 0x284) that is reserved in ext3/ext4 superblocks too
+ */
+#define CHANGE_GEN(sb) ((sb)->s_reserved[95])
+
+/* bit of a block or inode in its group's bitmap */
+#define BLOCK_BIT(sb, n_block) \
+    (((n_block) - (sb)->s_first_data_block) % (sb)->s_blocks_per_group)
+#define INODE_BIT(sb, n_inode) (((n_inode) - 1) % (sb)->s_inodes_per_group)
+#define CHANGE_MAP_MAGIC "EXT2CBT1"
+#define DELTA_MAGIC "EXT2DLT1"
+#define PACK_MAGIC "EXT2PAK1"
+#define PACK_CHUNK_BLOCKS 256
+
 typedef int (*cb_iterate_dent)(struct ext2_dir_entry *dent);
 
+/* ------------------- change tracking ------------------- */
+void load_change_map();
+void save_change_map();
+void make_change_map_path(char *path);
+void write_stream(const void *buf, size_t len, FILE *out);
+void read_stream(void *buf, size_t len, FILE *in);
+int is_block_packed(int n_block);
+/* ------------------- make file system ------------------- */
+void layout_image(struct ext2_super_block *new_sb, int n_blocks,
+                  int inode_ratio);
+int count_group_overhead(int n_group);
+void write_group_meta(int n_group, unsigned char *buf);
+void make_root_dirs();
+/* ------------------- image regions ------------------- */
+void load_journal();
+int map_journal_block(int i, int n_block);
+int count_meta_blocks();
+void advise_meta(int advice);
 /* ------------------- check type ------------------- */
 int get_inode_type(int n_inode);
 int is_inode_dir(int n_inode);
 int is_inode_reg(int n_inode);
 int is_inode_sym(int n_inode);
+int is_inode_fastsym(int n_inode);
+int get_inode_perms(int n_inode);
 int get_dent_type(const struct ext2_dir_entry *dent);
 int is_dent_dir(const struct ext2_dir_entry *dent);
 int is_dent_reg(const struct ext2_dir_entry *dent);
@@ -42,16 +98,30 @@ void free_inode(int n_inode);
 void init_block(int n_block);
 void init_inode(int n_inode);
 int alloc_block_any(int n_inode);
+int alloc_block_at(int n_inode, int i);
 int alloc_inode_w_mode(int mode);
 int alloc_inode_dir();
 int alloc_inode_reg();
 int alloc_inode_sym();
 int find_free_block();
 int find_free_inode();
+/* ------------------- block groups ------------------- */
+int count_groups();
+int count_group_blocks(int n_group);
+int group_has_super(int n_group);
+int count_gdt_blocks();
+int find_block_group(int n_block);
+int find_inode_group(int n_inode);
+struct ext2_group_desc *locate_group(int n_group);
+struct ext2_group_desc *locate_block_group(int n_block);
+struct ext2_group_desc *locate_inode_group(int n_inode);
+void mark_group_dirty(int n_group);
 /* ------------------- manipulate block/inode bitmap ------------------- */
 int chk_bit(int bit, const unsigned char *bitmap);
 void set_bit(int bit, unsigned char *bitmap);
 void clr_bit(int bit, unsigned char *bitmap);
+void set_bits(int from, int to, unsigned char *bitmap);
+int count_free_bits(const unsigned char *bitmap, int num);
 int chk_inodebit(int n_inode);
 int chk_blockbit(int n_block);
 void set_inodebit(int n_inode);
@@ -63,6 +133,12 @@ void *offset_ptr(void *ptr, int dist);
 int calc_offset_ptr(void *ptr1, void *ptr2);
 struct ext2_inode *locate_inode(int n_inode);
 void *locate_block(int n_block);
+void *locate_meta_block(int n_block);
+void *locate_new_block(int n_block);
+void prefetch_inode_blocks(int n_inode, int type);
+int find_inode_block(int n_inode);
+void mark_inode_dirty(int n_inode);
+void mark_counts_dirty();
 /* ------------------- manipulate dir_entry.name_len ------------------- */
 int get_name_len(const char *name);
 int padding_name_len(int name_len);
@@ -73,26 +149,95 @@ void init_dent(struct ext2_dir_entry *dir, unsigned int n_inode,
 void add_dent(int n_inode, int n_pdir_inode, const char *name, int file_type);
 int add_dent_in_block(int n_inode, int n_pdir_inode, const char *name, int type,
                       int n_block);
-void del_dent(int n_inode, int n_pdir_inode);
-int del_dent_in_block(int n_inode, int n_pdir_inode, int n_block);
+void del_dent(int n_inode, int n_pdir_inode, const char *name);
+int del_dent_in_block(int n_inode, int n_pdir_inode, const char *name,
+                      int n_block);
 void add_dent_dir(int n_inode, int n_pdir_inode, const char *name);
 void add_dent_reg(int n_inode, int n_pdir_inode, const char *name);
 void add_dent_sym(int n_inode, int n_pdir_inode, const char *name);
+int make_dir_in(int n_pdir_inode, const char *name);
+int make_sym_in(int n_pdir_inode, const char *name, const char *target);
 int iterate_dent(int n_pdir_inode, cb_iterate_dent cb);
+int list_dents(int n_dir_inode, int **inodes, char ***names);
 int find_dent_by_name(int n_pdir_inode, const char *name,
                       struct ext2_dir_entry **dent);
 int find_dent_dir_by_path(const struct path_tokens *pt);
 int find_dent_any_by_path(const struct path_tokens *pt);
 int find_dent_by_path(const struct path_tokens *pt, int *type);
+int resolve_path(const struct path_tokens *pt, int follow, int depth,
+                 int *type);
+int follow_symlink(int n_inode, const struct path_tokens *pt, int i,
+                   int depth, int *type);
+int read_symlink(int n_inode, char *target);
+/* ------------------- resolved path cache ------------------- */
+unsigned int hash_path_key(const char *key);
+void make_path_key(const struct path_tokens *pt, int num, char *key);
+int lookup_path_cache(const char *key, int *type);
+void insert_path_cache(const char *key, int n_inode, int type);
+void clear_path_cache();
+/* ------------------- directory free-space summary ------------------- */
+struct dir_gaps *get_dir_gaps(int n_pdir_inode);
+int calc_block_gap(int n_block);
+void update_dir_gaps(int n_pdir_inode, int n_block);
+void drop_dir_gaps(int n_pdir_inode);
+void clear_dir_gaps();
+/* ------------------- compact directory ------------------- */
+struct dent_chunk *collect_dent_chunks(int n_dir_inode, int flags, int *num);
+int cmp_dent_chunk(const void *a, const void *b);
+int compact_dir_inode(int n_dir_inode, int flags);
+/* ------------------- tar ------------------- */
+int find_new_parent(const char *path, struct path_tokens **pt);
+char *make_tar_path(const char *dst_dir, const char *name);
+char *read_tar_string(struct stream *st, long size);
+void read_pax_header(struct stream *st, long size, char **name, char **link);
+void skip_tar_data(struct stream *st, long size);
+int check_tar_header();
+long parse_tar_number(const char *field, int len);
+int import_tar_reg(struct stream *st, const char *dst, long size);
+void set_tar_meta(int n_inode);
+void collect_tar(int n_inode, const char *name);
+int cmp_tar_entry(const void *a, const void *b);
+long put_tar_entry(struct stream *st, int i, const char *link, int type);
+long put_tar_header(struct stream *st, const char *name, int n_inode,
+                    long size, int type, const char *link);
+/* ------------------- defragment ------------------- */
+int cb_collect_defrag(struct ext2_dir_entry *dent);
+int count_fragments(int n_inode);
+int find_free_run(int num);
+int defrag_inode(int n_inode);
+/* ------------------- metadata capture ------------------- */
+int cb_capture_inode(struct ext2_dir_entry *dent);
+void capture_group(int n_group);
+void capture_inode(int n_inode);
+int write_captured_blocks(const char *filename);
+int is_zero_block(const char *block);
+/* ------------------- recursive import ------------------- */
+void collect_import(const char *src, const char *name, int parent);
+void *import_reader(void *arg);
+void read_import_file(int i);
+void write_reg_data(int n_inode, const unsigned char *data, long len);
+/* ------------------- extract ------------------- */
+void collect_extract(int n_inode, const char *dst);
+void add_extract_job(int n_inode, const char *dst);
+void *extract_worker(void *arg);
+void write_extract_job(int i, char *buf);
+void pwrite_all(int fd, const void *buf, size_t len, off_t off,
+                const char *dst);
+/* ------------------- discard ------------------- */
+void queue_discard(int n_block);
+int flush_discard(int all_free, int *n_punched);
 struct ext2_dir_entry *find_deleteddent_helper(int n_pdir_inode,
                                                const char *name,
                                                struct ext2_dir_entry **prev_dir,
-                                               int *rec_len);
+                                               int *rec_len, int *n_dent_block);
 int find_deleteddent(int n_pdir_inode, const char *name, int *type);
 void restore_deleteddent(int n_pdir_inode, const char *name);
 /* ------------------- iterate blocks ------------------- */
 int find_block_linear(int n_inode, int i);
+int find_block_next(int n_inode, int *i);
 int find_block_lastused(int n_inode);
+int count_blocks(int n_inode);
+void truncate_blocks(int n_inode, int n_keep);
 /* ------------------- check image ------------------- */
 int check_bitmaps();
 int cb_check_i_mode(struct ext2_dir_entry *dent);
@@ -100,55 +245,738 @@ int cb_check_inode_mark(struct ext2_dir_entry *dent);
 int cb_check_inode_i_dtime(struct ext2_dir_entry *dent);
 int cb_check_block_mark(struct ext2_dir_entry *dent);
 
-static int fd = 0;
-static unsigned char *disk = NULL;
 static struct ext2_super_block *sb = NULL;
-static struct ext2_group_desc *gd = NULL;
-static unsigned char *block_bmp = NULL;
-static unsigned char *inode_bmp = NULL;
-static struct ext2_inode *inode_tbl = NULL;
+static struct ext2_group_desc *gd = NULL;  /* group 0 */
+
+/* resolved path prefix -> inode, valid for one open_image() session */
+static struct path_cache_entry {
+    char *key;
+    int n_inode;
+    int type;
+} path_cache[PATH_CACHE_SIZE];
+
+/* largest insertable dirent per directory block, built on first insert */
+static struct dir_gaps {
+    int n_inode;
+    int num;
+    int *blocks;
+    int *gaps;
+    int max;
+} dir_gaps_cache[DIR_GAPS_CACHE_SIZE];
+
+/* --discard: blocks freed this session, punched out at close_image() */
+static int discard = 0;
+static unsigned char *discard_bmp = NULL;
+
+/* sidecar <image>.cbt: per block, the generation that last wrote it */
+struct change_map_header {
+    char magic[8];
+    unsigned int n_blocks;
+    unsigned int generation;
+};
+static char *image_path = NULL;
+static unsigned int *change_map = NULL;
+
+/* ext2_delta stream: header, then runs of blocks, ended by an empty run */
+struct delta_header {
+    char magic[8];
+    unsigned int n_blocks;
+    unsigned int since;
+    unsigned int generation;
+};
+struct delta_run {
+    unsigned int n_block;
+    unsigned int num;
+};
+
+/* ext2_pack stream: header, then delta_runs of the used blocks */
+struct pack_header {
+    char magic[8];
+    unsigned int n_blocks;
+    unsigned int n_used;
+};
+
+/* lowest block/inode that may be free, so first-fit scans skip the rest */
+static int free_block_hint = 0;
+static int free_inode_hint = 0;
+
+/* ustar header, one TAR_BLOCK; numbers are NUL-terminated octal */
+#define TAR_BLOCK  512
+#define TAR_RECORD (20 * TAR_BLOCK)
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+/* import_tar(): the header being applied */
+static struct tar_header tar_hdr;
+
+/* export_tar() entries: directories in walk order, then the rest */
+struct tar_entry {
+    char *name; /* in the archive, no leading or trailing slash */
+    int n_inode;
+    int is_dir;
+    int n_first_block;
+    int order;
+};
+static struct tar_entry *tar_entries = NULL;
+static int tar_num = 0, tar_max = 0;
+
+/* the image has a journal, every operation goes through it */
+static int journaled = 0;
+
+/* --populate-meta: fault in (and huge-page) the metadata at open */
+static int populate_meta = 0;
+
+/* --stats[=json]: report counters and phase times at close_image() */
+static int stats = STATS_OFF;
+
+/* metadata blocks and inodes reached by capture_image() */
+static unsigned char *capture_map = NULL;
+static unsigned char *capture_seen = NULL;
+
+/* inodes queued by cb_collect_defrag(), each listed once */
+static int *defrag_inodes = NULL;
+static unsigned char *defrag_seen = NULL;
+static int defrag_num = 0;
+
+/*
+ * import_tree() entries in creation order, parents before children.
+ * Readers fill data/len/err and set ready under import_lock.
+ */
+struct import_entry {
+    char *src;           /* path on the host */
+    char *name;          /* name in the parent directory */
+    int parent;          /* entry of the parent directory, -1 at the top */
+    int is_dir;
+    int n_inode;         /* directories: inode once created */
+    unsigned char *data; /* files: contents read ahead */
+    long len;
+    int err;             /* errno of a failed read */
+    int ready;
+};
+
+/* files a reader may run ahead of the writer */
+#define IMPORT_WINDOW 256
+#define IMPORT_MAX_READERS 16
+
+static struct import_entry *import_entries = NULL;
+static int import_num = 0, import_max = 0;
+static int import_next_read = 0;  /* next entry a reader takes */
+static int import_next_write = 0; /* entry the writer is on */
+static pthread_mutex_t import_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t import_cond = PTHREAD_COND_INITIALIZER;
+
+/* extract_path() files: runs of logically and physically adjacent blocks */
+struct extract_run {
+    unsigned int index; /* first block in the file */
+    unsigned int n_block;
+    unsigned int num;
+};
+struct extract_job {
+    char *dst; /* path on the host */
+    int mode;
+    long size;
+    struct extract_run *runs;
+    int n_runs;
+};
+
+#define EXTRACT_MAX_WORKERS 16
+
+static struct extract_job *extract_jobs = NULL;
+static int extract_num = 0, extract_max = 0;
+static int extract_next = 0; /* next job a worker takes, under the lock */
+static int extract_dirs = 0, extract_syms = 0;
+static pthread_mutex_t extract_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a live dirent plus the restorable entries hidden in its slack */
+struct dent_chunk {
+    unsigned char *data;
+    int len;
+};
 
 /* ----------- Public Functions ----------- */
 
+int parse_image_opts(int argc, char **argv) {
+    int n = 1;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--discard")) {
+            discard = 1;
+        } else if (!strcmp(argv[i], "--io=mmap")) {
+            set_blockio_backend(BLOCKIO_MMAP);
+        } else if (!strcmp(argv[i], "--io=cache")) {
+            set_blockio_backend(BLOCKIO_CACHE);
+        } else if (!strcmp(argv[i], "--io=uring")) {
+            set_blockio_backend(BLOCKIO_URING);
+        } else if (!strncmp(argv[i], "--cache-kb=", 11)) {
+            set_blockio_cache_size(atol(argv[i] + 11));
+        } else if (!strcmp(argv[i], "--durability=none")) {
+            set_blockio_durability(DURABILITY_NONE);
+        } else if (!strcmp(argv[i], "--durability=commit")) {
+            set_blockio_durability(DURABILITY_COMMIT);
+        } else if (!strcmp(argv[i], "--durability=batch")) {
+            set_blockio_durability(DURABILITY_BATCH);
+        } else if (!strcmp(argv[i], "--overlay") && i + 1 < argc) {
+            set_blockio_overlay(argv[++i]);
+        } else if (!strcmp(argv[i], "--no-advice")) {
+            set_blockio_advice(0);
+        } else if (!strcmp(argv[i], "--populate-meta")) {
+            populate_meta = 1;
+        } else if (!strcmp(argv[i], "--stats")) {
+            stats = STATS_TEXT;
+        } else if (!strcmp(argv[i], "--stats=json")) {
+            stats = STATS_JSON;
+        } else if (!strcmp(argv[i], "--trace")) {
+            set_trace_output(NULL);
+        } else if (!strncmp(argv[i], "--trace=", 8)) {
+            set_trace_output(argv[i] + 8);
+        } else {
+            argv[n++] = argv[i];
+        }
+    }
+    argv[n] = NULL;
+
+    return n;
+}
+
+/*
+ * The superblock, group descriptors, and the bitmaps and inode table of
+ * the first group are pinned for the whole session, so the pointers kept
+ * below never go stale.
+ */
 void open_image(const char *filename) {
-    if ((fd = open(filename, O_RDWR)) == -1) {
-        perror("open");
-        exit(ENOENT);
+    int n_inode_tbl_blocks;
+
+    if (stats) {
+        start_stats();
     }
-    if ((disk = mmap(NULL, 128 * EXT2_BLOCK_SIZE, PROT_READ | PROT_WRITE,
-                     MAP_SHARED, fd, 0)) == MAP_FAILED) {
-        close(fd);
-        perror("mmap");
-        exit(EXIT_FAILURE);
+    free_block_hint = free_inode_hint = 0;
+
+    open_blockio(filename);
+
+    sb = locate_meta_block(1);
+    if (sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) {
+        /* metadata must reach the image through the log, not the mapping */
+        if (get_blockio_backend() == BLOCKIO_MMAP) {
+            close_blockio();
+            set_blockio_backend(BLOCKIO_CACHE);
+            open_blockio(filename);
+            sb = locate_meta_block(1);
+        }
+        load_journal();
+    }
+
+    pin_block(1);
+    sb = locate_meta_block(1);
+    for (int i = 0; i < count_gdt_blocks(); ++i) {
+        pin_block(sb->s_first_data_block + 1 + i);
+    }
+    gd = locate_group(0);
+    pin_block(gd->bg_block_bitmap);
+    pin_block(gd->bg_inode_bitmap);
+
+    n_inode_tbl_blocks =
+        sb->s_inodes_per_group * sizeof(struct ext2_inode) / EXT2_BLOCK_SIZE;
+    for (int i = 0; i < n_inode_tbl_blocks; ++i) {
+        pin_block(gd->bg_inode_table + i);
+    }
+
+    if (populate_meta) {
+        populate_blocks(0, count_meta_blocks());
+    } else {
+        advise_meta(BLOCKIO_ADV_WILLNEED);
+    }
+
+    if (!(image_path = strdup(filename))) {
+        perror("strdup");
+        exit(ENOMEM);
+    }
+    /* an overlay session leaves the base image's sidecar alone */
+    if (!get_blockio_overlay()) {
+        load_change_map();
+    }
+
+    if (stats) {
+        enter_stats_phase(PHASE_RUN);
     }
-    sb = locate_block(1);
-    gd = locate_block(2);
-    block_bmp = locate_block(gd->bg_block_bitmap);
-    inode_bmp = locate_block(gd->bg_inode_bitmap);
-    inode_tbl = locate_block(gd->bg_inode_table);
 }
 
 void close_image() {
-    if (disk && munmap(disk, 128 * EXT2_BLOCK_SIZE) != 0) {
-        perror("munmap");
-        exit(EXIT_FAILURE);
+    if (stats) {
+        enter_stats_phase(PHASE_CLOSE);
     }
-    if (close(fd) != 0) {
-        perror("close");
-        exit(EXIT_FAILURE);
+    if (discard_bmp) {
+        flush_discard(0, NULL);
+        free(discard_bmp);
+        discard_bmp = NULL;
+    }
+    if (change_map) {
+        save_change_map();
+    }
+    free(image_path);
+    image_path = NULL;
+    close_blockio();
+    if (journaled) {
+        close_journal();
+        journaled = 0;
+    }
+    if (stats) {
+        print_stats(stats);
     }
-    fd = 0;
-    disk = NULL;
     sb = NULL;
     gd = NULL;
-    block_bmp = inode_bmp = NULL;
-    inode_tbl = NULL;
+    clear_path_cache();
+    clear_dir_gaps();
+}
+
+/*
+ * Create filename as a sparse image of n_blocks blocks with one inode per
+ * inode_ratio bytes. Only superblocks, descriptors and bitmaps are written;
+ * inode tables are left as holes, which read back as zeroed inodes.
+ */
+void make_image(const char *filename, int n_blocks, int inode_ratio) {
+    struct ext2_super_block new_sb;
+    unsigned char *buf;
+    int fd, n_gdt_blocks;
+
+    /* the group helpers below work on the layout being built */
+    layout_image(&new_sb, n_blocks, inode_ratio);
+    sb = &new_sb;
+    n_gdt_blocks = count_gdt_blocks();
+
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        perror(filename);
+        exit(EEXIST);
+    }
+    if (ftruncate(fd, (off_t)sb->s_blocks_count * EXT2_BLOCK_SIZE) != 0) {
+        perror("ftruncate");
+        exit(EIO);
+    }
+    close(fd);
+
+    if (!(buf = calloc(n_gdt_blocks + 1, EXT2_BLOCK_SIZE))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+
+    open_blockio(filename);
+    for (int g = 0; g < count_groups(); ++g) {
+        write_group_meta(g, buf);
+    }
+    for (int g = 0; g < count_groups(); ++g) {
+        if (group_has_super(g)) {
+            sb->s_block_group_nr = g;
+            memcpy(buf, sb, sizeof(struct ext2_super_block));
+            write_raw_block(sb->s_first_data_block +
+                                g * sb->s_blocks_per_group,
+                            buf);
+        }
+    }
+    sync_raw_blocks();
+    close_blockio();
+
+    printf("Created %s: %u blocks, %u inodes in %d groups\n", filename,
+           sb->s_blocks_count, sb->s_inodes_count, count_groups());
+
+    sb = NULL;
+    free(buf);
+
+    open_image(filename);
+    make_root_dirs();
+    close_image();
+}
+
+/*
+ * Store an empty journal of n_blocks blocks in the reserved journal
+ * inode; later sessions log their metadata there (see open_image()).
+ */
+void create_journal(int n_blocks) {
+    struct ext2_inode *inode;
+    int *blocks;
+    int n_map, per;
+
+    if (sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) {
+        fprintf(stderr, "image already has a journal\n");
+        exit(EEXIST);
+    }
+    if (n_blocks < JOURNAL_MIN_BLOCKS || n_blocks > JOURNAL_MAX_BLOCKS) {
+        fprintf(stderr, "journal size must be between %d and %d blocks\n",
+                JOURNAL_MIN_BLOCKS, JOURNAL_MAX_BLOCKS);
+        exit(EINVAL);
+    }
+    /* the indirect block, then the double-indirect and its children */
+    per = EXT2_BLOCK_SIZE / 4;
+    n_map = 1;
+    if (n_blocks > 12 + per) {
+        n_map += 1 + (n_blocks - 12 - 1) / per;
+    }
+    if (sb->s_free_blocks_count < n_blocks + n_map) {
+        fprintf(stderr, "not enough free blocks for the journal\n");
+        exit(ENOSPC);
+    }
+
+    init_inode(EXT2_JOURNAL_INO);
+    inode = locate_inode(EXT2_JOURNAL_INO);
+    inode->i_mode = EXT2_S_IFREG | 0600;
+    inode->i_links_count = 1;
+    if (!chk_inodebit(EXT2_JOURNAL_INO)) {
+        set_inodebit(EXT2_JOURNAL_INO);
+        --sb->s_free_inodes_count;
+        --locate_inode_group(EXT2_JOURNAL_INO)->bg_free_inodes_count;
+    }
+
+    if (!(blocks = malloc(n_blocks * sizeof(int)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    n_map = 0;
+    for (int i = 0; i < n_blocks; ++i) {
+        blocks[i] = alloc_block();
+        n_map += map_journal_block(i, blocks[i]);
+    }
+    inode = locate_inode(EXT2_JOURNAL_INO);
+    inode->i_size = n_blocks * EXT2_BLOCK_SIZE;
+    inode->i_blocks = (n_blocks + n_map) * (EXT2_BLOCK_SIZE / 512);
+    mark_inode_dirty(EXT2_JOURNAL_INO);
+    format_journal(blocks, n_blocks, sb->s_uuid);
+    free(blocks);
+
+    sb->s_feature_compat |= EXT3_FEATURE_COMPAT_HAS_JOURNAL;
+    sb->s_journal_inum = EXT2_JOURNAL_INO;
+    mark_counts_dirty();
+
+    printf("Created journal: %d blocks in inode [%d]\n", n_blocks,
+           EXT2_JOURNAL_INO);
+}
+
+/*
+ * Start tracking changes: every block counts as unchanged since the
+ * current generation, so a replica needs one full copy first.
+ */
+void init_change_map() {
+    char path[PATH_MAX];
+
+    if (get_blockio_overlay()) {
+        fprintf(stderr, "changes are not tracked through --overlay\n");
+        exit(EINVAL);
+    }
+    if (change_map) {
+        fprintf(stderr, "image already tracks changes\n");
+        exit(EEXIST);
+    }
+    if (!(change_map = calloc(count_blockio_blocks(), sizeof(int)))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+    for (int i = 0; i < count_blockio_blocks(); ++i) {
+        change_map[i] = CHANGE_GEN(sb);
+    }
+    /* an empty session still stores the map with the next generation */
+    mark_counts_dirty();
+
+    make_change_map_path(path);
+    printf("Tracking changes in %s from generation %u\n", path,
+           CHANGE_GEN(sb));
+}
+
+/*
+ * Write every block changed after generation since to out, as runs of
+ * adjacent blocks. Returns the number of blocks written.
+ */
+int export_delta(unsigned int since, FILE *out) {
+    struct delta_header header;
+    struct delta_run run;
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    int n_exported;
+
+    if (!change_map) {
+        fprintf(stderr, "image does not track changes\n");
+        exit(EINVAL);
+    }
+    if (since > CHANGE_GEN(sb)) {
+        fprintf(stderr, "image is only at generation %u\n", CHANGE_GEN(sb));
+        exit(EINVAL);
+    }
+
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    header.n_blocks = count_blockio_blocks();
+    header.since = since;
+    header.generation = CHANGE_GEN(sb);
+    write_stream(&header, sizeof(header), out);
+
+    n_exported = 0;
+    for (int i = 0; i < count_blockio_blocks();) {
+        if (change_map[i] <= since) {
+            ++i;
+            continue;
+        }
+        run.n_block = i;
+        for (run.num = 0; i + run.num < count_blockio_blocks() &&
+                          change_map[i + run.num] > since;
+             ++run.num)
+            ;
+        write_stream(&run, sizeof(run), out);
+        for (int j = 0; j < run.num; ++j) {
+            read_raw_block(i + j, buf);
+            write_stream(buf, EXT2_BLOCK_SIZE, out);
+        }
+        n_exported += run.num;
+        i += run.num;
+    }
+    run.n_block = run.num = 0;
+    write_stream(&run, sizeof(run), out);
+
+    if (fflush(out) != 0) {
+        perror("fflush");
+        exit(EIO);
+    }
+
+    return n_exported;
+}
+
+/*
+ * Write a delta stream into an image that is at the generation the
+ * delta starts from. Works below the file system: no session is open.
+ */
+int apply_delta(const char *filename, FILE *in) {
+    struct delta_header header;
+    struct delta_run run;
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    struct ext2_super_block *image_sb;
+    int n_applied;
+
+    open_blockio(filename);
+
+    read_stream(&header, sizeof(header), in);
+    if (memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) ||
+        header.n_blocks != count_blockio_blocks()) {
+        fprintf(stderr, "delta does not match %s\n", filename);
+        exit(EINVAL);
+    }
+    read_raw_block(1, buf);
+    image_sb = (struct ext2_super_block *)buf;
+    if (header.since && CHANGE_GEN(image_sb) != header.since) {
+        fprintf(stderr, "image is at generation %u, delta starts at %u\n",
+                CHANGE_GEN(image_sb), header.since);
+        exit(EINVAL);
+    }
+
+    n_applied = 0;
+    for (;;) {
+        read_stream(&run, sizeof(run), in);
+        if (!run.num) {
+            break;
+        }
+        if (run.n_block + run.num > count_blockio_blocks()) {
+            fprintf(stderr, "delta run out of range\n");
+            exit(EINVAL);
+        }
+        for (int i = 0; i < run.num; ++i) {
+            read_stream(buf, EXT2_BLOCK_SIZE, in);
+            write_raw_block(run.n_block + i, buf);
+        }
+        n_applied += run.num;
+    }
+    sync_raw_blocks();
+
+    close_blockio();
+
+    return n_applied;
+}
+
+/*
+ * Write the metadata and the blocks the bitmap marks used to out, as
+ * runs read in large chunks while the previous chunk is being written.
+ * Returns the number of blocks written.
+ */
+int pack_image(FILE *out) {
+    struct pack_header header;
+    struct delta_run run;
+    struct stream *st;
+    char *buf;
+    int num;
+
+    if (!(buf = malloc(PACK_CHUNK_BLOCKS * EXT2_BLOCK_SIZE))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.n_blocks = count_blockio_blocks();
+    header.n_used = 0;
+    for (int i = 0; i < count_blockio_blocks(); ++i) {
+        header.n_used += is_block_packed(i);
+    }
+
+    advise_blocks(0, count_blockio_blocks(), BLOCKIO_ADV_SEQUENTIAL);
+    st = open_stream(out, STREAM_OUT);
+    stream_put(st, &header, sizeof(header));
+    for (int i = 0; i < count_blockio_blocks();) {
+        if (!is_block_packed(i)) {
+            ++i;
+            continue;
+        }
+        run.n_block = i;
+        for (run.num = 0; i + run.num < count_blockio_blocks() &&
+                          is_block_packed(i + run.num);
+             ++run.num)
+            ;
+        stream_put(st, &run, sizeof(run));
+        for (int j = 0; j < run.num; j += num) {
+            num = MIN(run.num - j, PACK_CHUNK_BLOCKS);
+            read_raw_blocks(i + j, num, buf);
+            STAT_ADD(bytes_copied, num * EXT2_BLOCK_SIZE);
+            stream_put(st, buf, num * EXT2_BLOCK_SIZE);
+        }
+        i += run.num;
+    }
+    run.n_block = run.num = 0;
+    stream_put(st, &run, sizeof(run));
+    close_stream(st);
+    advise_blocks(0, count_blockio_blocks(), BLOCKIO_ADV_RANDOM);
+
+    free(buf);
+
+    return header.n_used;
+}
+
+/*
+ * Create filename from a pack stream as a sparse file: the free blocks
+ * are holes. Works below the file system: no session is open.
+ */
+int unpack_image(const char *filename, FILE *in) {
+    struct pack_header header;
+    struct delta_run run;
+    struct stream *st;
+    char *buf;
+    int fd, num, n_unpacked;
+
+    if (!(buf = malloc(PACK_CHUNK_BLOCKS * EXT2_BLOCK_SIZE))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    st = open_stream(in, STREAM_IN);
+    stream_get(st, &header, sizeof(header));
+    if (memcmp(header.magic, PACK_MAGIC, sizeof(header.magic)) ||
+        !header.n_blocks) {
+        fprintf(stderr, "not a packed image\n");
+        exit(EINVAL);
+    }
+
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        perror(filename);
+        exit(EEXIST);
+    }
+    if (ftruncate(fd, (off_t)header.n_blocks * EXT2_BLOCK_SIZE) != 0) {
+        perror("ftruncate");
+        exit(EIO);
+    }
+    close(fd);
+
+    open_blockio(filename);
+    n_unpacked = 0;
+    for (;;) {
+        stream_get(st, &run, sizeof(run));
+        if (!run.num) {
+            break;
+        }
+        if (run.n_block + run.num > header.n_blocks) {
+            fprintf(stderr, "pack run out of range\n");
+            exit(EINVAL);
+        }
+        for (int j = 0; j < run.num; j += num) {
+            num = MIN(run.num - j, PACK_CHUNK_BLOCKS);
+            stream_get(st, buf, num * EXT2_BLOCK_SIZE);
+            write_raw_blocks(run.n_block + j, num, buf);
+        }
+        n_unpacked += run.num;
+    }
+    if (n_unpacked != header.n_used) {
+        fprintf(stderr, "pack holds %d blocks, header says %u\n",
+                n_unpacked, header.n_used);
+        exit(EINVAL);
+    }
+    sync_raw_blocks();
+    close_blockio();
+    close_stream(st);
+
+    free(buf);
+
+    return n_unpacked;
+}
+
+/*
+ * Write a copy of the image to filename that holds only the metadata:
+ * each group's headers and inode table, directory, symlink and indirect
+ * blocks, and the journal. File data stays behind as holes. Returns the
+ * number of blocks written.
+ */
+int capture_image(const char *filename) {
+    int n_captured;
+
+    if (!(capture_map = calloc(count_blockio_blocks() / 8 + 1, 1)) ||
+        !(capture_seen = calloc(sb->s_inodes_count / 8 + 1, 1))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+
+    for (int i = 0; i < count_meta_blocks(); ++i) {
+        set_bit(i, capture_map);
+    }
+    for (int g = 1; g < count_groups(); ++g) {
+        capture_group(g);
+    }
+    capture_inode(EXT2_ROOT_INO);
+    iterate_dent(EXT2_ROOT_INO, cb_capture_inode);
+    if (sb->s_journal_inum && chk_inodebit(sb->s_journal_inum)) {
+        capture_inode(sb->s_journal_inum);
+    }
+
+    n_captured = write_captured_blocks(filename);
+
+    free(capture_map);
+    free(capture_seen);
+    capture_map = NULL;
+    capture_seen = NULL;
+
+    return n_captured;
+}
+
+void trim_image() {
+    int n_runs, n_blocks;
+
+    advise_meta(BLOCKIO_ADV_SEQUENTIAL);
+    if ((n_runs = flush_discard(1, &n_blocks)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    advise_meta(BLOCKIO_ADV_RANDOM);
+
+    printf("Discarded %d free blocks in %d runs\n", n_blocks, n_runs);
 }
 
 void check_image() {
     int cnt;
 
+    advise_meta(BLOCKIO_ADV_SEQUENTIAL);
     cnt = check_bitmaps();
+    advise_meta(BLOCKIO_ADV_RANDOM);
     cnt += iterate_dent(2, cb_check_i_mode);
     cnt += iterate_dent(2, cb_check_inode_mark);
     cnt += iterate_dent(2, cb_check_inode_i_dtime);
@@ -176,21 +1004,23 @@ int cb_check_block_mark(struct ext2_dir_entry *dent) {
     inode = locate_inode(n_inode);
     n_fixed_blocks = 0;
 
-    int i = 0;
-    while ((n_block = find_block_linear(n_inode, i++))) {
+    if (is_inode_fastsym(n_inode)) {
+        return 0;
+    }
+
+    for (int i = 0; (n_block = find_block_next(n_inode, &i)); ++i) {
         if (!chk_blockbit(n_block)) {
             set_blockbit(n_block);
             --sb->s_free_blocks_count;
-            --gd->bg_free_blocks_count;
+            --locate_block_group(n_block)->bg_free_blocks_count;
             ++n_fixed_blocks;
         }
     }
-    if (i > 13) {
-        n_block = inode->i_block[12];
+    if ((n_block = inode->i_block[12])) {
         if (!chk_blockbit(n_block)) {
             set_blockbit(n_block);
             --sb->s_free_blocks_count;
-            --gd->bg_free_blocks_count;
+            --locate_block_group(n_block)->bg_free_blocks_count;
             ++n_fixed_blocks;
         }
     }
@@ -219,6 +1049,7 @@ int cb_check_inode_i_dtime(struct ext2_dir_entry *dent) {
 
     if (inode->i_dtime != 0) {
         inode->i_dtime = 0;
+        mark_inode_dirty(n_inode);
         printf("Fixed: valid inode marked for deletion: [%d]\n", n_inode);
         return 1;
     }
@@ -238,7 +1069,7 @@ int cb_check_inode_mark(struct ext2_dir_entry *dent) {
     if (!chk_inodebit(n_inode)) {
         set_inodebit(n_inode);
         --sb->s_free_inodes_count;
-        --gd->bg_free_inodes_count;
+        --locate_inode_group(n_inode)->bg_free_inodes_count;
         printf("Fixed: inode [%d] not marked as in­use\n", n_inode);
         return 1;
     }
@@ -285,53 +1116,74 @@ int check_bitmaps() {
     int cnt;
     int n_free_inodes, n_free_blocks;
     int n_free_inodes_diff, n_free_blocks_diff;
+    int *n_group_free;
+    struct ext2_group_desc *bg;
 
     cnt = 0;
 
+    if (!(n_group_free = malloc(count_groups() * sizeof(int)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
     n_free_inodes = 0;
-    for (int n_inode = 1; n_inode <= sb->s_inodes_count; ++n_inode) {
-        if (!chk_inodebit(n_inode)) {
-            ++n_free_inodes;
-        }
+    for (int g = 0; g < count_groups(); ++g) {
+        n_group_free[g] = count_free_bits(
+            locate_meta_block(locate_group(g)->bg_inode_bitmap),
+            sb->s_inodes_per_group);
+        n_free_inodes += n_group_free[g];
     }
 
     if ((n_free_inodes_diff = sb->s_free_inodes_count - n_free_inodes)) {
         sb->s_free_inodes_count = n_free_inodes;
+        mark_counts_dirty();
         printf("Fixed: superblock's free inodes counter was off by %d compared "
                "to the bitmap\n",
                ABS(n_free_inodes_diff));
         cnt += ABS(n_free_inodes_diff);
     }
-    if ((n_free_inodes_diff = gd->bg_free_inodes_count - n_free_inodes)) {
-        gd->bg_free_inodes_count = n_free_inodes;
-        printf("Fixed: block group's free inodes counter was off by %d "
-               "compared to the bitmap\n",
-               ABS(n_free_inodes_diff));
-        cnt += ABS(n_free_inodes_diff);
+    for (int g = 0; g < count_groups(); ++g) {
+        bg = locate_group(g);
+        if ((n_free_inodes_diff = bg->bg_free_inodes_count - n_group_free[g])) {
+            bg->bg_free_inodes_count = n_group_free[g];
+            mark_group_dirty(g);
+            printf("Fixed: block group's free inodes counter was off by %d "
+                   "compared to the bitmap\n",
+                   ABS(n_free_inodes_diff));
+            cnt += ABS(n_free_inodes_diff);
+        }
     }
 
     n_free_blocks = 0;
-    for (int n_block = 1; n_block <= sb->s_blocks_count; ++n_block) {
-        if (!chk_blockbit(n_block)) {
-            ++n_free_blocks;
-        }
+    for (int g = 0; g < count_groups(); ++g) {
+        n_group_free[g] = count_free_bits(
+            locate_meta_block(locate_group(g)->bg_block_bitmap),
+            count_group_blocks(g));
+        n_free_blocks += n_group_free[g];
     }
 
     if ((n_free_blocks_diff = sb->s_free_blocks_count - n_free_blocks)) {
         sb->s_free_blocks_count = n_free_blocks;
+        mark_counts_dirty();
         printf("Fixed: superblock's free blocks counter was off by %d compared "
                "to the bitmap\n",
                ABS(n_free_blocks_diff));
         cnt += ABS(n_free_blocks_diff);
     }
-    if ((n_free_blocks_diff = gd->bg_free_blocks_count - n_free_blocks)) {
-        gd->bg_free_blocks_count = n_free_blocks;
-        printf("Fixed: block group's free blocks counter was off by %d "
-               "compared to the bitmap\n",
-               ABS(n_free_blocks_diff));
-        cnt += ABS(n_free_blocks_diff);
+    for (int g = 0; g < count_groups(); ++g) {
+        bg = locate_group(g);
+        if ((n_free_blocks_diff = bg->bg_free_blocks_count - n_group_free[g])) {
+            bg->bg_free_blocks_count = n_group_free[g];
+            mark_group_dirty(g);
+            printf("Fixed: block group's free blocks counter was off by %d "
+                   "compared to the bitmap\n",
+                   ABS(n_free_blocks_diff));
+            cnt += ABS(n_free_blocks_diff);
+        }
     }
 
+    free(n_group_free);
+
     return cnt;
 }
 
@@ -342,6 +1194,8 @@ void restore_reg_or_lnk(const char *dst_path) {
     int n_block;
     int type;
 
+    TRACE_BEGIN(TRACE_RESTORE);
+
     dst_pt = create_path_tokens(dst_path);
     pdir_pt = create_path_tokens(dst_path);
     pop_path_token(pdir_pt);
@@ -375,19 +1229,22 @@ void restore_reg_or_lnk(const char *dst_path) {
 
     dst_inode = locate_inode(n_dst_inode);
     if (dst_inode->i_links_count > 0) {
-        int i = 0;
-        while ((n_block = find_block_linear(n_dst_inode, i++))) {
-            restore_block(n_block);
-        }
-        if (i > 13) {
-            restore_block(dst_inode->i_block[12]);
+        if (!is_inode_fastsym(n_dst_inode)) {
+            for (int i = 0; (n_block = find_block_next(n_dst_inode, &i)); ++i) {
+                restore_block(n_block);
+            }
+            if (dst_inode->i_block[12]) {
+                restore_block(dst_inode->i_block[12]);
+            }
         }
         restore_inode(n_dst_inode);
         dst_inode->i_dtime = 0;
+        mark_inode_dirty(n_dst_inode);
     }
 
     destroy_path_tokens(dst_pt);
     destroy_path_tokens(pdir_pt);
+    TRACE_END(TRACE_RESTORE);
 }
 
 void remove_reg_or_lnk(const char *dst_path) {
@@ -396,6 +1253,8 @@ void remove_reg_or_lnk(const char *dst_path) {
     struct path_tokens *dst_pt, *pdir_pt;
     int n_block;
 
+    TRACE_BEGIN(TRACE_RM);
+
     dst_pt = create_path_tokens(dst_path);
     pdir_pt = create_path_tokens(dst_path);
     pop_path_token(pdir_pt);
@@ -415,31 +1274,110 @@ void remove_reg_or_lnk(const char *dst_path) {
         exit(ENOENT);
     }
 
-    del_dent(n_dst_inode, n_pdir_inode);
+    del_dent(n_dst_inode, n_pdir_inode, get_path_tokens_last(dst_pt));
 
     dst_inode = locate_inode(n_dst_inode);
     if (dst_inode->i_links_count == 0) {
-        int i = 0;
-        while ((n_block = find_block_linear(n_dst_inode, i++))) {
-            free_block(n_block);
-        }
-        if (i > 13) {
-            free_block(dst_inode->i_block[12]);
+        if (!is_inode_fastsym(n_dst_inode)) {
+            for (int i = 0; (n_block = find_block_next(n_dst_inode, &i)); ++i) {
+                free_block(n_block);
+            }
+            if (dst_inode->i_block[12]) {
+                free_block(dst_inode->i_block[12]);
+            }
         }
         free_inode(n_dst_inode);
         dst_inode->i_dtime = time(NULL);
+        mark_inode_dirty(n_dst_inode);
     }
 
     destroy_path_tokens(dst_pt);
     destroy_path_tokens(pdir_pt);
+    TRACE_END(TRACE_RM);
+}
+
+/*
+ * Rename src_path to dst_path, or into it if dst_path is a directory. The
+ * entry is linked under its new name before the old one is dropped, and a
+ * moved directory's .. is repointed, so no data is copied.
+ */
+void move_path(const char *src_path, const char *dst_path) {
+    int n_inode, n_src_pdir_inode, n_dst_pdir_inode, n_up;
+    int type;
+    struct ext2_dir_entry *dent;
+    struct path_tokens *src_pt, *src_pdir_pt, *dst_pt, *dst_pdir_pt;
+    const char *name;
+
+    TRACE_BEGIN(TRACE_MV);
+
+    src_pt = create_path_tokens(src_path);
+    src_pdir_pt = create_path_tokens(src_path);
+    pop_path_token(src_pdir_pt);
+    dst_pt = create_path_tokens(dst_path);
+    dst_pdir_pt = create_path_tokens(dst_path);
+    pop_path_token(dst_pdir_pt);
+
+    if (src_pt->num == 0) {
+        fprintf(stderr, "%s cannot be moved\n", src_path);
+        exit(EINVAL);
+    }
+    if ((n_inode = find_dent_by_path(src_pt, &type)) < 0) {
+        fprintf(stderr, "%s not found\n", src_path);
+        exit(ENOENT);
+    }
+    n_src_pdir_inode = find_dent_dir_by_path(src_pdir_pt);
+
+    if ((n_dst_pdir_inode = find_dent_dir_by_path(dst_pt)) >= 0) {
+        name = get_path_tokens_last(src_pt);
+    } else if ((n_dst_pdir_inode = find_dent_dir_by_path(dst_pdir_pt)) >= 0) {
+        name = get_path_tokens_last(dst_pt);
+    } else {
+        fprintf(stderr, "parent directory of %s not found\n", dst_path);
+        exit(ENOENT);
+    }
+    if (find_dent_by_name(n_dst_pdir_inode, name, &dent) > 0) {
+        fprintf(stderr, "%s already exists\n", dst_path);
+        exit(EEXIST);
+    }
+
+    /* a directory may not end up below itself */
+    if (type == EXT2_FT_DIR) {
+        for (n_up = n_dst_pdir_inode; n_up != EXT2_ROOT_INO;
+             n_up = find_dent_by_name(n_up, "..", &dent)) {
+            if (n_up == n_inode) {
+                fprintf(stderr, "%s cannot be moved into itself\n",
+                        src_path);
+                exit(EINVAL);
+            }
+        }
+    }
+
+    add_dent(n_inode, n_dst_pdir_inode, name, type);
+    del_dent(n_inode, n_src_pdir_inode, get_path_tokens_last(src_pt));
+
+    if (type == EXT2_FT_DIR && n_src_pdir_inode != n_dst_pdir_inode) {
+        find_dent_by_name(n_inode, "..", &dent);
+        dent->inode = n_dst_pdir_inode;
+        mark_block_dirty(find_block_linear(n_inode, 0));
+        --locate_inode(n_src_pdir_inode)->i_links_count;
+        mark_inode_dirty(n_src_pdir_inode);
+        ++locate_inode(n_dst_pdir_inode)->i_links_count;
+        mark_inode_dirty(n_dst_pdir_inode);
+    }
+    clear_path_cache();
+
+    destroy_path_tokens(src_pt);
+    destroy_path_tokens(src_pdir_pt);
+    destroy_path_tokens(dst_pt);
+    destroy_path_tokens(dst_pdir_pt);
+    TRACE_END(TRACE_MV);
 }
 
 void create_lnk(const char *src_path, const char *dst_path, int symlnk) {
-    int n_src_inode, n_dst_inode, n_pdir_inode;
-    struct ext2_inode *dst_inode;
+    int n_src_inode, n_pdir_inode;
     struct path_tokens *src_pt, *dst_pt, *pdir_pt;
-    int n_block;
-    unsigned char *block;
+
+    TRACE_BEGIN(TRACE_LN);
 
     src_pt = create_path_tokens(src_path);
     dst_pt = create_path_tokens(dst_path);
@@ -462,14 +1400,7 @@ void create_lnk(const char *src_path, const char *dst_path, int symlnk) {
     }
 
     if (symlnk) {
-        n_dst_inode = alloc_inode_sym();
-        dst_inode = locate_inode(n_dst_inode);
-        add_dent_sym(n_dst_inode, n_pdir_inode, get_path_tokens_last(dst_pt));
-        n_block = alloc_block_any(n_dst_inode);
-        block = locate_block(n_block);
-        memcpy(block, src_path, strlen(src_path));
-        dst_inode->i_size = strlen(src_path);
-        dst_inode->i_dtime = 0;
+        make_sym_in(n_pdir_inode, get_path_tokens_last(dst_pt), src_path);
     } else {
         if (is_inode_dir(n_src_inode)) {
             fprintf(stderr, "%s refers to a directory\n", src_path);
@@ -481,6 +1412,7 @@ void create_lnk(const char *src_path, const char *dst_path, int symlnk) {
     destroy_path_tokens(src_pt);
     destroy_path_tokens(dst_pt);
     destroy_path_tokens(pdir_pt);
+    TRACE_END(TRACE_LN);
 }
 
 void create_reg(FILE *fp, const char *dst_path) {
@@ -491,6 +1423,8 @@ void create_reg(FILE *fp, const char *dst_path) {
     int actual_sz, expect_sz, remaining_sz, total_sz;
     unsigned char *block;
 
+    TRACE_BEGIN(TRACE_CP);
+
     dst_pt = create_path_tokens(dst_path);
     pdir_pt = create_path_tokens(dst_path);
     pop_path_token(pdir_pt);
@@ -511,396 +1445,2740 @@ void create_reg(FILE *fp, const char *dst_path) {
 
     add_dent_reg(n_dst_inode, n_pdir_inode, get_path_tokens_last(dst_pt));
 
+    TRACE_BEGIN(TRACE_COPY);
     fseek(fp, 0L, SEEK_END);
     remaining_sz = total_sz = ftell(fp);
     fseek(fp, 0L, SEEK_SET);
 
     while (remaining_sz > 0) {
         n_block = alloc_block_any(n_dst_inode);
-        block = locate_block(n_block);
+        block = locate_new_block(n_block);
         expect_sz = MIN(remaining_sz, EXT2_BLOCK_SIZE);
         actual_sz = fread(block, 1, expect_sz, fp);
         while (actual_sz < expect_sz) {
             actual_sz += fread(block + actual_sz, 1, expect_sz - actual_sz, fp);
         }
+        STAT_ADD(bytes_copied, actual_sz);
+        mark_block_dirty(n_block);
+        put_block(n_block);
         remaining_sz -= actual_sz;
     }
+    TRACE_END(TRACE_COPY);
 
     dst_inode->i_size = total_sz;
     dst_inode->i_dtime = 0;
+    mark_inode_dirty(n_dst_inode);
 
     destroy_path_tokens(dst_pt);
     destroy_path_tokens(pdir_pt);
+    TRACE_END(TRACE_CP);
 }
 
-void create_dir(const char *dir_path) {
-    int n_dir_inode, n_pdir_inode;
-    struct ext2_inode *dir_inode;
-    struct path_tokens *dir_pt, *pdir_pt;
-
-    dir_pt = create_path_tokens(dir_path);
-    pdir_pt = create_path_tokens(dir_path);
-    pop_path_token(pdir_pt);
+/*
+ * Bring the regular file dst_path in line with fp, rewriting only the
+ * blocks whose contents differ and allocating or freeing at the tail.
+ * dst_path is created as by create_reg() if it does not exist yet.
+ */
+void update_reg(FILE *fp, const char *dst_path) {
+    int n_dst_inode;
+    struct ext2_inode *dst_inode;
+    struct path_tokens *dst_pt;
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    unsigned char *block;
+    long total_sz, len;
+    int n_block, n_old, n_new, n_changed;
 
-    if ((n_pdir_inode = find_dent_dir_by_path(pdir_pt)) < 0) {
-        fprintf(stderr, "parent directory of %s not found\n", dir_path);
-        exit(ENOENT);
+    dst_pt = create_path_tokens(dst_path);
+    n_dst_inode = find_dent_any_by_path(dst_pt);
+    destroy_path_tokens(dst_pt);
+    if (n_dst_inode < 0) {
+        create_reg(fp, dst_path);
+        return;
     }
-
-    if (find_dent_any_by_path(dir_pt) > 0) {
-        fprintf(stderr, "%s already exists\n", dir_path);
-        exit(EEXIST);
+    if (!is_inode_reg(n_dst_inode)) {
+        fprintf(stderr, "%s is not a regular file\n", dst_path);
+        exit(EINVAL);
     }
 
-    n_dir_inode = alloc_inode_dir();
-    dir_inode = locate_inode(n_dir_inode);
-
-    dir_inode->i_dtime = 0;
+    TRACE_BEGIN(TRACE_CP);
 
-    add_dent_dir(n_dir_inode, n_pdir_inode, get_path_tokens_last(dir_pt));
-    alloc_block_any(n_dir_inode);
-    add_dent_dir(n_dir_inode, n_dir_inode, ".");
-    add_dent_dir(n_pdir_inode, n_dir_inode, "..");
+    fseek(fp, 0L, SEEK_END);
+    total_sz = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    if (total_sz > 0 && (total_sz - 1) / EXT2_BLOCK_SIZE >=
+                            12 + EXT2_BLOCK_SIZE / sizeof(unsigned int)) {
+        fprintf(stderr, "file too large\n");
+        exit(EFBIG);
+    }
 
-    ++gd->bg_used_dirs_count;
+    dst_inode = locate_inode(n_dst_inode);
+    n_old = (dst_inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    n_new = (total_sz + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    truncate_blocks(n_dst_inode, n_new);
+
+    TRACE_BEGIN(TRACE_COPY);
+    n_changed = 0;
+    for (int i = 0; i < n_new; ++i) {
+        len = MIN(total_sz - (long)i * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+        if (fread(buf, 1, len, fp) != len) {
+            perror("fread");
+            exit(EIO);
+        }
+        memset(buf + len, 0, EXT2_BLOCK_SIZE - len);
 
-    destroy_path_tokens(dir_pt);
-    destroy_path_tokens(pdir_pt);
-}
+        if ((n_block = find_block_linear(n_dst_inode, i))) {
+            block = locate_block(n_block);
+            if (!memcmp(block, buf, len)) {
+                put_block(n_block);
+                continue;
+            }
+        } else if (i < n_old && is_zero_block((const char *)buf)) {
+            /* still a hole */
+            continue;
+        } else {
+            n_block = alloc_block_at(n_dst_inode, i);
+            block = locate_new_block(n_block);
+        }
+        memcpy(block, buf, EXT2_BLOCK_SIZE);
+        STAT_ADD(bytes_copied, len);
+        mark_block_dirty(n_block);
+        put_block(n_block);
+        ++n_changed;
+    }
+    TRACE_END(TRACE_COPY);
 
-/* ----------- Private Functions ----------- */
+    dst_inode = locate_inode(n_dst_inode);
+    dst_inode->i_size = total_sz;
+    mark_inode_dirty(n_dst_inode);
 
-/* ------------------- iterate blocks ------------------- */
+    printf("%d of %d blocks rewritten\n", n_changed, n_new);
+    TRACE_END(TRACE_CP);
+}
 
-int find_block_linear(int n_inode, int i) {
+/*
+ * Cut the regular file path down to size bytes, freeing whole blocks past
+ * it, or grow it to size with a hole. The bytes past the end of the last
+ * block are zeroed, so a later append or grow reads them back as zeros.
+ */
+void truncate_reg(const char *path, long size) {
+    int n_inode, n_block;
     struct ext2_inode *inode;
-    int n_block;
-    unsigned int *block;
+    struct path_tokens *pt;
+    long old_size, off;
 
-    inode = locate_inode(n_inode);
-
-    if (i < 12) {
-        n_block = inode->i_block[i];
+    pt = create_path_tokens(path);
+    if ((n_inode = find_dent_any_by_path(pt)) < 0) {
+        fprintf(stderr, "%s not found\n", path);
+        exit(ENOENT);
+    }
+    destroy_path_tokens(pt);
+    if (!is_inode_reg(n_inode)) {
+        fprintf(stderr, "%s is not a regular file\n", path);
+        exit(EINVAL);
+    }
+    if (size < 0 || (size > 0 && (size - 1) / EXT2_BLOCK_SIZE >=
+                                     12 + EXT2_BLOCK_SIZE / 4)) {
+        fprintf(stderr, "file too large\n");
+        exit(EFBIG);
+    }
+
+    inode = locate_inode(n_inode);
+    old_size = inode->i_size;
+    truncate_blocks(n_inode, (size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE);
+
+    /* the tail of the block the old or new end falls in */
+    off = MIN(size, old_size);
+    if (off % EXT2_BLOCK_SIZE &&
+        (n_block = find_block_linear(n_inode, off / EXT2_BLOCK_SIZE))) {
+        memset((char *)locate_block(n_block) + off % EXT2_BLOCK_SIZE, 0,
+               EXT2_BLOCK_SIZE - off % EXT2_BLOCK_SIZE);
+        mark_block_dirty(n_block);
+        put_block(n_block);
+    }
+
+    inode = locate_inode(n_inode);
+    inode->i_size = size;
+    mark_inode_dirty(n_inode);
+}
+
+/*
+ * Add what is left to read from fp to the end of the regular file
+ * dst_path, creating it if need be. Writing starts in the block holding
+ * the current end and allocates by index from there on.
+ */
+void append_reg(FILE *fp, const char *dst_path) {
+    int n_dst_inode;
+    struct ext2_inode *dst_inode;
+    struct path_tokens *dst_pt;
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    unsigned char *block;
+    long size;
+    int n_block, i, off, len;
+
+    dst_pt = create_path_tokens(dst_path);
+    n_dst_inode = find_dent_any_by_path(dst_pt);
+    destroy_path_tokens(dst_pt);
+    if (n_dst_inode < 0) {
+        create_reg(fp, dst_path);
+        return;
+    }
+    if (!is_inode_reg(n_dst_inode)) {
+        fprintf(stderr, "%s is not a regular file\n", dst_path);
+        exit(EINVAL);
+    }
+
+    TRACE_BEGIN(TRACE_CP);
+    TRACE_BEGIN(TRACE_COPY);
+    size = locate_inode(n_dst_inode)->i_size;
+    for (;;) {
+        off = size % EXT2_BLOCK_SIZE;
+        if (!(len = fread(buf, 1, EXT2_BLOCK_SIZE - off, fp))) {
+            break;
+        }
+        i = size / EXT2_BLOCK_SIZE;
+        if (!(n_block = find_block_linear(n_dst_inode, i))) {
+            n_block = alloc_block_at(n_dst_inode, i);
+        }
+        block = locate_block(n_block);
+        memcpy(block + off, buf, len);
+        STAT_ADD(bytes_copied, len);
+        mark_block_dirty(n_block);
+        put_block(n_block);
+        size += len;
+    }
+    if (ferror(fp)) {
+        perror("fread");
+        exit(EIO);
+    }
+    TRACE_END(TRACE_COPY);
+
+    dst_inode = locate_inode(n_dst_inode);
+    dst_inode->i_size = size;
+    dst_inode->i_dtime = 0;
+    mark_inode_dirty(n_dst_inode);
+    TRACE_END(TRACE_CP);
+}
+
+void create_dir(const char *dir_path) {
+    int n_pdir_inode;
+    struct path_tokens *dir_pt, *pdir_pt;
+
+    TRACE_BEGIN(TRACE_MKDIR);
+
+    dir_pt = create_path_tokens(dir_path);
+    pdir_pt = create_path_tokens(dir_path);
+    pop_path_token(pdir_pt);
+
+    if ((n_pdir_inode = find_dent_dir_by_path(pdir_pt)) < 0) {
+        fprintf(stderr, "parent directory of %s not found\n", dir_path);
+        exit(ENOENT);
+    }
+
+    if (find_dent_any_by_path(dir_pt) > 0) {
+        fprintf(stderr, "%s already exists\n", dir_path);
+        exit(EEXIST);
+    }
+
+    make_dir_in(n_pdir_inode, get_path_tokens_last(dir_pt));
+
+    destroy_path_tokens(dir_pt);
+    destroy_path_tokens(pdir_pt);
+    TRACE_END(TRACE_MKDIR);
+}
+
+void compact_dir(const char *dir_path, int flags) {
+    int n_dir_inode;
+    struct path_tokens *dir_pt;
+
+    dir_pt = create_path_tokens(dir_path);
+
+    if ((n_dir_inode = find_dent_dir_by_path(dir_pt)) < 0) {
+        fprintf(stderr, "%s not found as directory\n", dir_path);
+        exit(ENOENT);
+    }
+
+    compact_dir_inode(n_dir_inode, flags);
+
+    destroy_path_tokens(dir_pt);
+}
+
+void defrag_path(const char *path) {
+    int n_inode;
+    int type;
+    int cnt;
+    struct path_tokens *pt;
+
+    pt = create_path_tokens(path);
+
+    if ((n_inode = find_dent_by_path(pt, &type)) < 0) {
+        fprintf(stderr, "%s not found\n", path);
+        exit(ENOENT);
+    }
+
+    if (!(defrag_inodes = calloc(sb->s_inodes_count + 1, sizeof(int))) ||
+        !(defrag_seen = calloc(sb->s_inodes_count / 8 + 1, 1))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+    defrag_num = 0;
+    defrag_inodes[defrag_num++] = n_inode;
+    set_bit(n_inode - 1, defrag_seen);
+    if (type == EXT2_FT_DIR) {
+        iterate_dent(n_inode, cb_collect_defrag);
+    }
+
+    cnt = 0;
+    for (int i = 0; i < defrag_num; ++i) {
+        cnt += defrag_inode(defrag_inodes[i]);
+        release_blocks();
+    }
+
+    if (cnt > 0) {
+        printf("%d files defragmented!\n", cnt);
     } else {
-        block = locate_block(inode->i_block[12]);
+        printf("No fragmented files found!\n");
+    }
+
+    free(defrag_inodes);
+    free(defrag_seen);
+    defrag_inodes = NULL;
+    defrag_seen = NULL;
+    destroy_path_tokens(pt);
+}
+
+/* Inode path resolves to, or -1 if it does not exist. */
+int lookup_path(const char *path) {
+    int n_inode;
+    int type;
+    struct path_tokens *pt;
+
+    pt = create_path_tokens(path);
+    n_inode = find_dent_by_path(pt, &type);
+    destroy_path_tokens(pt);
+    return n_inode;
+}
+
+/* Inode ext2_restore would bring back for path, or -1. */
+int lookup_deleted_path(const char *path) {
+    int n_inode, n_pdir_inode;
+    int type;
+    struct path_tokens *pt, *pdir_pt;
+
+    pt = create_path_tokens(path);
+    pdir_pt = create_path_tokens(path);
+    pop_path_token(pdir_pt);
+
+    n_inode = -1;
+    if ((n_pdir_inode = find_dent_dir_by_path(pdir_pt)) >= 0 &&
+        find_dent_any_by_path(pt) < 0) {
+        n_inode = find_deleteddent(n_pdir_inode, get_path_tokens_last(pt),
+                                   &type);
+    }
+    destroy_path_tokens(pt);
+    destroy_path_tokens(pdir_pt);
+    return n_inode;
+}
+
+/*
+ * Copy the host tree src to the new path dst_path. n_readers threads read
+ * host files ahead while this thread alone allocates and links, creating
+ * entries under parent inodes it kept, without walking paths again.
+ */
+void import_tree(const char *src, const char *dst_path, int n_readers) {
+    int n_pdir_inode, n_top_pdir_inode;
+    struct import_entry *e;
+    struct ext2_dir_entry *dent;
+    struct path_tokens *dst_pt, *pdir_pt;
+    pthread_t readers[IMPORT_MAX_READERS];
+    int err, n_files, n_dirs;
+
+    dst_pt = create_path_tokens(dst_path);
+    pdir_pt = create_path_tokens(dst_path);
+    pop_path_token(pdir_pt);
+
+    if ((n_top_pdir_inode = find_dent_dir_by_path(pdir_pt)) < 0) {
+        fprintf(stderr, "parent directory of %s not found\n", dst_path);
+        exit(ENOENT);
+    }
+    if (find_dent_by_name(n_top_pdir_inode, get_path_tokens_last(dst_pt),
+                          &dent) > 0) {
+        fprintf(stderr, "%s already exists\n", dst_path);
+        exit(EEXIST);
+    }
+
+    collect_import(src, get_path_tokens_last(dst_pt), -1);
+
+    n_readers = MAX(1, MIN(n_readers, IMPORT_MAX_READERS));
+    import_next_read = import_next_write = 0;
+    for (int i = 0; i < n_readers; ++i) {
+        if ((err = pthread_create(&readers[i], NULL, import_reader, NULL))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(err);
+        }
+    }
+
+    n_files = n_dirs = 0;
+    for (int i = 0; i < import_num; ++i) {
+        e = &import_entries[i];
+        n_pdir_inode = e->parent < 0 ? n_top_pdir_inode
+                                     : import_entries[e->parent].n_inode;
+        if (e->is_dir) {
+            e->n_inode = make_dir_in(n_pdir_inode, e->name);
+            ++n_dirs;
+        } else {
+            pthread_mutex_lock(&import_lock);
+            while (!e->ready) {
+                pthread_cond_wait(&import_cond, &import_lock);
+            }
+            pthread_mutex_unlock(&import_lock);
+            if (e->err) {
+                fprintf(stderr, "%s: %s\n", e->src, strerror(e->err));
+                exit(e->err);
+            }
+            e->n_inode = alloc_inode_reg();
+            add_dent_reg(e->n_inode, n_pdir_inode, e->name);
+            write_reg_data(e->n_inode, e->data, e->len);
+            free(e->data);
+            e->data = NULL;
+            ++n_files;
+        }
+        release_blocks();
+
+        pthread_mutex_lock(&import_lock);
+        import_next_write = i + 1;
+        pthread_cond_broadcast(&import_cond);
+        pthread_mutex_unlock(&import_lock);
+    }
+
+    for (int i = 0; i < n_readers; ++i) {
+        pthread_join(readers[i], NULL);
+    }
+
+    for (int i = 0; i < import_num; ++i) {
+        free(import_entries[i].src);
+        free(import_entries[i].name);
+    }
+    free(import_entries);
+    import_entries = NULL;
+    import_num = import_max = 0;
+    destroy_path_tokens(dst_pt);
+    destroy_path_tokens(pdir_pt);
+
+    printf("%d files and %d directories copied\n", n_files, n_dirs);
+}
+
+/*
+ * Copy path out to the host path dst, or into it if dst is a directory.
+ * Directories and symlinks are made while walking the tree; file data is
+ * then written by n_workers threads, one pwrite per contiguous run.
+ */
+void extract_path(const char *path, const char *dst, int recursive,
+                  int n_workers) {
+    int n_inode;
+    int type;
+    struct path_tokens *pt;
+    struct stat st;
+    pthread_t workers[EXTRACT_MAX_WORKERS];
+    char *dst_path;
+    long total;
+    int err;
+
+    pt = create_path_tokens(path);
+
+    if ((n_inode = find_dent_by_path(pt, &type)) < 0) {
+        fprintf(stderr, "%s not found\n", path);
+        exit(ENOENT);
+    }
+    if (is_inode_dir(n_inode) && !recursive) {
+        fprintf(stderr, "%s refers to a directory\n", path);
+        exit(EISDIR);
+    }
+
+    if (stat(dst, &st) == 0 && S_ISDIR(st.st_mode) && pt->num > 0) {
+        if (asprintf(&dst_path, "%s/%s", dst, get_path_tokens_last(pt)) < 0) {
+            perror("asprintf");
+            exit(ENOMEM);
+        }
+    } else if (!(dst_path = strdup(dst))) {
+        perror("strdup");
+        exit(ENOMEM);
+    }
+
+    extract_dirs = extract_syms = 0;
+    collect_extract(n_inode, dst_path);
+
+    advise_blocks(0, count_blockio_blocks(), BLOCKIO_ADV_SEQUENTIAL);
+    n_workers = MAX(1, MIN(n_workers, EXTRACT_MAX_WORKERS));
+    extract_next = 0;
+    for (int i = 0; i < n_workers; ++i) {
+        if ((err = pthread_create(&workers[i], NULL, extract_worker, NULL))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(err);
+        }
+    }
+    for (int i = 0; i < n_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    advise_blocks(0, count_blockio_blocks(), BLOCKIO_ADV_RANDOM);
+
+    printf("%d files, %d directories and %d symlinks extracted\n",
+           extract_num, extract_dirs, extract_syms);
+
+    total = 0;
+    for (int i = 0; i < extract_num; ++i) {
+        total += extract_jobs[i].size;
+        free(extract_jobs[i].dst);
+        free(extract_jobs[i].runs);
+    }
+    STAT_ADD(bytes_copied, total);
+    free(extract_jobs);
+    extract_jobs = NULL;
+    extract_num = extract_max = 0;
+    free(dst_path);
+    destroy_path_tokens(pt);
+}
+
+/*
+ * Unpack the tar stream in under the directory dst_dir. Directories that
+ * already exist are merged into; file bodies go from the stream straight
+ * into their blocks. Hard links must follow their target, as tar writes.
+ */
+void import_tar(FILE *in, const char *dst_dir) {
+    static const char zero[TAR_BLOCK];
+    struct stream *st;
+    struct path_tokens *pt;
+    char *name, *link, *dst, *src;
+    long size, skip;
+    int n_inode, n_pdir_inode;
+    int n_files, n_dirs, n_links;
+
+    if ((n_inode = lookup_path(dst_dir)) < 0 || !is_inode_dir(n_inode)) {
+        fprintf(stderr, "%s not found as directory\n", dst_dir);
+        exit(ENOENT);
+    }
+
+    st = open_stream(in, STREAM_IN);
+    name = link = NULL;
+    n_files = n_dirs = n_links = 0;
+    for (;;) {
+        stream_get(st, &tar_hdr, TAR_BLOCK);
+        if (!memcmp(&tar_hdr, zero, TAR_BLOCK)) {
+            break;
+        }
+        if (check_tar_header() != 0) {
+            fprintf(stderr, "invalid tar header\n");
+            exit(EINVAL);
+        }
+        size = parse_tar_number(tar_hdr.size, sizeof(tar_hdr.size));
+
+        /* extensions naming the next entry */
+        if (tar_hdr.typeflag == 'L' || tar_hdr.typeflag == 'K') {
+            if (tar_hdr.typeflag == 'L') {
+                free(name);
+                name = read_tar_string(st, size);
+            } else {
+                free(link);
+                link = read_tar_string(st, size);
+            }
+            continue;
+        }
+        if (tar_hdr.typeflag == 'x') {
+            read_pax_header(st, size, &name, &link);
+            continue;
+        }
+        if (tar_hdr.typeflag == 'g') {
+            skip_tar_data(st, (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK);
+            continue;
+        }
+
+        if (!name && asprintf(&name, "%.*s%s%.*s",
+                              (int)strnlen(tar_hdr.prefix, 155),
+                              tar_hdr.prefix, tar_hdr.prefix[0] ? "/" : "",
+                              (int)strnlen(tar_hdr.name, 100),
+                              tar_hdr.name) < 0) {
+            perror("asprintf");
+            exit(ENOMEM);
+        }
+        if (!link && !(link = strndup(tar_hdr.linkname, 100))) {
+            perror("strndup");
+            exit(ENOMEM);
+        }
+
+        /* the data left to skip once the entry is made */
+        skip = size;
+        if (!(dst = make_tar_path(dst_dir, name))) {
+            /* the archive root itself, or a path leaving it */
+        } else if (tar_hdr.typeflag == '5') {
+            if ((n_inode = lookup_path(dst)) < 0) {
+                create_dir(dst);
+                n_inode = lookup_path(dst);
+                ++n_dirs;
+            } else if (!is_inode_dir(n_inode)) {
+                fprintf(stderr, "%s already exists\n", dst);
+                exit(EEXIST);
+            }
+            set_tar_meta(n_inode);
+        } else if (tar_hdr.typeflag == '0' || tar_hdr.typeflag == '\0' ||
+                   tar_hdr.typeflag == '7') {
+            set_tar_meta(import_tar_reg(st, dst, size));
+            skip = 0;
+            ++n_files;
+        } else if (tar_hdr.typeflag == '1') {
+            if (!(src = make_tar_path(dst_dir, link))) {
+                fprintf(stderr, "%s: invalid link target %s\n", name, link);
+                exit(EINVAL);
+            }
+            create_lnk(src, dst, 0);
+            free(src);
+            ++n_links;
+        } else if (tar_hdr.typeflag == '2') {
+            if (strlen(link) >= EXT2_BLOCK_SIZE) {
+                fprintf(stderr, "%s: link target too long\n", name);
+                exit(ENAMETOOLONG);
+            }
+            n_pdir_inode = find_new_parent(dst, &pt);
+            n_inode = make_sym_in(n_pdir_inode, get_path_tokens_last(pt), link);
+            set_tar_meta(n_inode);
+            destroy_path_tokens(pt);
+            ++n_links;
+        } else {
+            fprintf(stderr, "%s: entry type '%c' not supported, skipped\n",
+                    name, tar_hdr.typeflag);
+        }
+        skip_tar_data(st, skip + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+
+        free(dst);
+        free(name);
+        free(link);
+        name = link = NULL;
+        release_blocks();
+    }
+    close_stream(st);
+    free(name);
+    free(link);
+
+    printf("%d files, %d directories and %d links imported\n", n_files,
+           n_dirs, n_links);
+}
+
+/*
+ * Write path, and everything below it, to out as a tar stream. Directories
+ * come first so every parent precedes its entries; the rest follow in the
+ * order of their first block, so the image is read front to back.
+ */
+void export_tar(const char *path, FILE *out) {
+    static const char zero[TAR_RECORD];
+    struct path_tokens *pt;
+    struct tar_entry *e;
+    struct stream *st;
+    char target[EXT2_BLOCK_SIZE + 1];
+    int *first;
+    int n_inode, type;
+    long total;
+
+    pt = create_path_tokens(path);
+    if ((n_inode = find_dent_by_path(pt, &type)) < 0) {
+        fprintf(stderr, "%s not found\n", path);
+        exit(ENOENT);
+    }
+
+    collect_tar(n_inode, pt->num > 0 ? get_path_tokens_last(pt) : "");
+    qsort(tar_entries, tar_num, sizeof(struct tar_entry), cmp_tar_entry);
+
+    /* entry + 1 of each inode's first name, later names are hard links */
+    if (!(first = calloc(sb->s_inodes_count + 1, sizeof(int)))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+
+    st = open_stream(out, STREAM_OUT);
+    total = 0;
+    for (int i = 0; i < tar_num; ++i) {
+        e = &tar_entries[i];
+        if (!e->name[0]) {
+            continue;
+        }
+        if (e->is_dir) {
+            total += put_tar_entry(st, i, "", '5');
+        } else if (first[e->n_inode]) {
+            total += put_tar_entry(st, i,
+                                   tar_entries[first[e->n_inode] - 1].name,
+                                   '1');
+        } else if (is_inode_sym(e->n_inode)) {
+            first[e->n_inode] = i + 1;
+            read_symlink(e->n_inode, target);
+            total += put_tar_entry(st, i, target, '2');
+        } else {
+            first[e->n_inode] = i + 1;
+            total += put_tar_entry(st, i, "", '0');
+        }
+        release_blocks();
+    }
+    /* two zero blocks end the archive, then pad out the record */
+    stream_put(st, zero, 2 * TAR_BLOCK);
+    total += 2 * TAR_BLOCK;
+    stream_put(st, zero, (TAR_RECORD - total % TAR_RECORD) % TAR_RECORD);
+    close_stream(st);
+
+    for (int i = 0; i < tar_num; ++i) {
+        free(tar_entries[i].name);
+    }
+    free(tar_entries);
+    tar_entries = NULL;
+    tar_num = tar_max = 0;
+    free(first);
+    destroy_path_tokens(pt);
+}
+
+/* ----------- Private Functions ----------- */
+
+/* ------------------- iterate blocks ------------------- */
+
+int find_block_linear(int n_inode, int i) {
+    struct ext2_inode *inode;
+    int n_block;
+    unsigned int *block;
+
+    STAT_INC(blocks_mapped);
+    inode = locate_inode(n_inode);
+
+    if (i < 12) {
+        n_block = inode->i_block[i];
+    } else if (i - 12 < EXT2_BLOCK_SIZE / 4) {
+        if (!inode->i_block[12]) {
+            return 0;
+        }
+        block = locate_meta_block(inode->i_block[12]);
         n_block = block[i - 12];
+    } else if (inode->i_block[13] && i < JOURNAL_MAX_BLOCKS) {
+        /* double indirect: only the journal gets this large */
+        i -= 12 + EXT2_BLOCK_SIZE / 4;
+        block = locate_meta_block(inode->i_block[13]);
+        if ((n_block = block[i / (EXT2_BLOCK_SIZE / 4)])) {
+            block = locate_meta_block(n_block);
+            n_block = block[i % (EXT2_BLOCK_SIZE / 4)];
+        }
+    } else {
+        n_block = 0;
+    }
+
+    return n_block;
+}
+
+/*
+ * First mapped block at index *i or later, with *i moved onto it, or 0 once
+ * nothing is mapped past *i. Holes left by truncate_reg() and append_reg()
+ * are stepped over, so walkers built on this see every block of the file.
+ */
+int find_block_next(int n_inode, int *i) {
+    struct ext2_inode *inode;
+    int n_block;
+
+    if (is_inode_fastsym(n_inode)) {
+        return 0;
+    }
+    inode = locate_inode(n_inode);
+
+    for (; *i < JOURNAL_MAX_BLOCKS; ++*i) {
+        if (*i >= 12 && *i < 12 + EXT2_BLOCK_SIZE / 4 && !inode->i_block[12]) {
+            *i = 12 + EXT2_BLOCK_SIZE / 4;
+        }
+        if (*i >= 12 + EXT2_BLOCK_SIZE / 4 && !inode->i_block[13]) {
+            break;
+        }
+        if ((n_block = find_block_linear(n_inode, *i))) {
+            return n_block;
+        }
+    }
+
+    return 0;
+}
+
+int find_block_lastused(int n_inode) {
+    struct ext2_inode *inode;
+    int n_block;
+    int is_found;
+    unsigned int *block;
+
+    inode = locate_inode(n_inode);
+
+    for (int i = 1; i < 13; ++i) {
+        if (!inode->i_block[i]) {
+            n_block = inode->i_block[i - 1];
+            is_found = 1;
+            break;
+        }
+    }
+
+    if (!is_found) {
+        block = locate_meta_block(inode->i_block[12]);
+        for (int i = 1; i < EXT2_BLOCK_SIZE / 4; ++i) {
+            if (!block[i]) {
+                n_block = block[i - 1];
+                break;
+            }
+        }
+    }
+
+    return n_block;
+}
+
+/* Number of mapped data blocks, not counting holes. */
+int count_blocks(int n_inode) {
+    int cnt = 0;
+    for (int i = 0; find_block_next(n_inode, &i); ++i) {
+        ++cnt;
+    }
+    return cnt;
+}
+
+/* Free every data block from index n_keep on, and the indirect block if
+ * nothing is left behind it. i_size is left to the caller. */
+void truncate_blocks(int n_inode, int n_keep) {
+    struct ext2_inode *inode;
+    unsigned int *block;
+
+    inode = locate_inode(n_inode);
+
+    for (int i = n_keep; i < 12; ++i) {
+        if (inode->i_block[i]) {
+            free_block(inode->i_block[i]);
+            inode->i_block[i] = 0;
+            inode->i_blocks -= EXT2_BLOCK_SIZE / 512;
+        }
+    }
+    mark_inode_dirty(n_inode);
+
+    if (!inode->i_block[12]) {
+        return;
+    }
+
+    block = locate_meta_block(inode->i_block[12]);
+    for (int i = MAX(n_keep - 12, 0); i < EXT2_BLOCK_SIZE / 4; ++i) {
+        if (block[i]) {
+            free_block(block[i]);
+            block[i] = 0;
+            inode->i_blocks -= EXT2_BLOCK_SIZE / 512;
+        }
+    }
+    mark_block_dirty(inode->i_block[12]);
+    if (n_keep <= 12) {
+        free_block(inode->i_block[12]);
+        inode->i_block[12] = 0;
+    }
+    mark_inode_dirty(n_inode);
+}
+
+/* ------------------- manipulate dir_entry ------------------- */
+
+void add_dent_dir(int n_inode, int n_pdir_inode, const char *name) {
+    add_dent(n_inode, n_pdir_inode, name, EXT2_FT_DIR);
+}
+void add_dent_reg(int n_inode, int n_pdir_inode, const char *name) {
+    add_dent(n_inode, n_pdir_inode, name, EXT2_FT_REG_FILE);
+}
+void add_dent_sym(int n_inode, int n_pdir_inode, const char *name) {
+    add_dent(n_inode, n_pdir_inode, name, EXT2_FT_SYMLINK);
+}
+
+/* Symlink name in n_pdir_inode pointing at target. */
+int make_sym_in(int n_pdir_inode, const char *name, const char *target) {
+    int n_inode;
+    struct ext2_inode *inode;
+    int n_block;
+    unsigned char *block;
+
+    n_inode = alloc_inode_sym();
+    inode = locate_inode(n_inode);
+    add_dent_sym(n_inode, n_pdir_inode, name);
+    if (strlen(target) < sizeof(inode->i_block)) {
+        /* fast symlink: target lives in i_block[], i_blocks stays 0 */
+        memcpy(inode->i_block, target, strlen(target));
+    } else {
+        n_block = alloc_block_any(n_inode);
+        block = locate_block(n_block);
+        memcpy(block, target, strlen(target));
+        mark_block_dirty(n_block);
+    }
+    inode->i_size = strlen(target);
+    inode->i_dtime = 0;
+    mark_inode_dirty(n_inode);
+
+    return n_inode;
+}
+
+/* New directory name in n_pdir_inode, with its . and .. entries. */
+int make_dir_in(int n_pdir_inode, const char *name) {
+    int n_dir_inode;
+    struct ext2_inode *dir_inode;
+
+    n_dir_inode = alloc_inode_dir();
+    dir_inode = locate_inode(n_dir_inode);
+
+    dir_inode->i_dtime = 0;
+    mark_inode_dirty(n_dir_inode);
+
+    add_dent_dir(n_dir_inode, n_pdir_inode, name);
+    alloc_block_any(n_dir_inode);
+    add_dent_dir(n_dir_inode, n_dir_inode, ".");
+    add_dent_dir(n_pdir_inode, n_dir_inode, "..");
+
+    ++locate_inode_group(n_dir_inode)->bg_used_dirs_count;
+    mark_group_dirty(find_inode_group(n_dir_inode));
+
+    return n_dir_inode;
+}
+
+void init_dent(struct ext2_dir_entry *dir, unsigned int n_inode,
+               unsigned short rec_len, unsigned char name_len,
+               unsigned char file_type, const char *name) {
+    // memset(dir, 0, rec_len);
+    dir->inode = n_inode;
+    dir->rec_len = rec_len;
+    dir->name_len = name_len;
+    dir->file_type = file_type;
+    strncpy(dir->name, name, name_len);
+}
+
+void add_dent(int n_inode, int n_pdir_inode, const char *name, int type) {
+    struct ext2_inode *inode;
+    struct dir_gaps *dg;
+    int n_block;
+    int dir_entry_len;
+
+    TRACE_BEGIN(TRACE_DENT);
+    inode = locate_inode(n_inode);
+    dg = get_dir_gaps(n_pdir_inode);
+    dir_entry_len = sizeof(struct ext2_dir_entry) + get_name_len(name);
+
+    if (dg->num > 0 && dg->gaps[dg->max] >= dir_entry_len) {
+        n_block = dg->blocks[dg->max];
+    } else {
+        n_block = alloc_block_any(n_pdir_inode);
+    }
+
+    if (!add_dent_in_block(n_inode, n_pdir_inode, name, type, n_block)) {
+        ++inode->i_links_count;
+        mark_inode_dirty(n_inode);
+    }
+    update_dir_gaps(n_pdir_inode, n_block);
+    TRACE_END(TRACE_DENT);
+}
+
+/*
+ * Insert into the slack after the last entry if it fits, as ext2 does,
+ * otherwise into the first gap left behind by a deleted entry.
+ */
+int add_dent_in_block(int n_inode, int n_pdir_inode, const char *name, int type,
+                      int n_block) {
+    int name_len;
+    int dir_entry_len;
+    struct ext2_dir_entry *dir, *gap_dir;
+    int min_rec_len, extra_len;
+
+    name_len = strlen(name);
+    dir_entry_len = sizeof(struct ext2_dir_entry) + get_name_len(name);
+    gap_dir = NULL;
+
+    dir = locate_meta_block(n_block);
+
+    for (int len = 0; len < EXT2_BLOCK_SIZE;
+         len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+        if (dir->rec_len == 0) {
+            extra_len = EXT2_BLOCK_SIZE - len;
+            if (extra_len >= dir_entry_len) {
+                init_dent(dir, n_inode, extra_len, name_len, type, name);
+                mark_block_dirty(n_block);
+                return 0;
+            }
+            break;
+        }
+        if (dir->inode == 0) {
+            min_rec_len = 0;
+        } else {
+            min_rec_len = sizeof(struct ext2_dir_entry) +
+                          padding_name_len(dir->name_len);
+        }
+        extra_len = dir->rec_len - min_rec_len;
+        if (extra_len >= dir_entry_len &&
+            (!gap_dir || len + dir->rec_len == EXT2_BLOCK_SIZE)) {
+            gap_dir = dir;
+        }
+    }
+
+    if (!gap_dir) {
+        return -1;
+    }
+
+    if (gap_dir->inode == 0) {
+        init_dent(gap_dir, n_inode, gap_dir->rec_len, name_len, type, name);
+    } else {
+        min_rec_len = sizeof(struct ext2_dir_entry) +
+                      padding_name_len(gap_dir->name_len);
+        extra_len = gap_dir->rec_len - min_rec_len;
+        gap_dir->rec_len = min_rec_len;
+        dir = offset_ptr(gap_dir, min_rec_len);
+        init_dent(dir, n_inode, extra_len, name_len, type, name);
+    }
+    mark_block_dirty(n_block);
+
+    return 0;
+}
+
+void del_dent(int n_inode, int n_pdir_inode, const char *name) {
+    struct ext2_inode *inode;
+    int n_block;
+    int deleted;
+
+    inode = locate_inode(n_inode);
+    deleted = 0;
+
+    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
+        if (!del_dent_in_block(n_inode, n_pdir_inode, name, n_block)) {
+            update_dir_gaps(n_pdir_inode, n_block);
+            deleted = 1;
+            break;
+        }
+    }
+
+    if (deleted) {
+        --inode->i_links_count;
+        mark_inode_dirty(n_inode);
+        clear_path_cache();
+    }
+}
+
+int del_dent_in_block(int n_inode, int n_pdir_inode, const char *name,
+                      int n_block) {
+    struct ext2_dir_entry *dir, *prev_dir;
+    int name_len;
+    int ret;
+
+    name_len = strlen(name);
+    prev_dir = NULL;
+    dir = locate_meta_block(n_block);
+    ret = -1;
+
+    for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
+         len += dir->rec_len, prev_dir = dir,
+             dir = offset_ptr(dir, dir->rec_len)) {
+        if (dir->inode == n_inode && dir->name_len == name_len &&
+            !strncmp(dir->name, name, name_len)) {
+            if (prev_dir) {
+                prev_dir->rec_len += dir->rec_len;
+            } else {
+                dir->inode = 0;
+            }
+            mark_block_dirty(n_block);
+            ret = 0;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+int iterate_dent(int n_pdir_inode, cb_iterate_dent cb) {
+    int cnt, cb_cnt;
+    struct ext2_dir_entry *dir;
+    int n_block;
+
+    cnt = 0;
+
+    prefetch_inode_blocks(n_pdir_inode, BLOCK_META);
+
+    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
+        dir = locate_meta_block(n_block);
+        for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
+             len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+            STAT_INC(dents_visited);
+            /* a callback reporting a fix may have rewritten the entry */
+            if ((cb_cnt = cb(dir)) > 0) {
+                mark_block_dirty(n_block);
+            }
+            cnt += cb_cnt;
+            if (dir->name_len == 1 && !strncmp(dir->name, ".", 1)) {
+                continue;
+            }
+            if (dir->name_len == 2 && !strncmp(dir->name, "..", 2)) {
+                continue;
+            }
+            if (is_dent_dir(dir)) {
+                cnt += iterate_dent(dir->inode, cb);
+            }
+        }
+    }
+
+    return cnt;
+}
+
+/*
+ * Copy out the live entries of a directory but . and .., so they stay
+ * valid once its blocks may be evicted. The caller frees both arrays.
+ */
+int list_dents(int n_dir_inode, int **inodes, char ***names) {
+    struct ext2_dir_entry *dir;
+    int n_block, num, max;
+
+    num = max = 0;
+    *inodes = NULL;
+    *names = NULL;
+    for (int i = 0; (n_block = find_block_linear(n_dir_inode, i)); ++i) {
+        dir = locate_meta_block(n_block);
+        for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
+             len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+            STAT_INC(dents_visited);
+            if (dir->inode == 0 ||
+                (dir->name_len == 1 && !strncmp(dir->name, ".", 1)) ||
+                (dir->name_len == 2 && !strncmp(dir->name, "..", 2))) {
+                continue;
+            }
+            if (num == max) {
+                max = max ? max * 2 : 64;
+                if (!(*inodes = realloc(*inodes, max * sizeof(int))) ||
+                    !(*names = realloc(*names, max * sizeof(char *)))) {
+                    perror("realloc");
+                    exit(ENOMEM);
+                }
+            }
+            (*inodes)[num] = dir->inode;
+            if (!((*names)[num++] = strndup(dir->name, dir->name_len))) {
+                perror("strndup");
+                exit(ENOMEM);
+            }
+        }
+    }
+    return num;
+}
+
+int find_dent_by_name(int n_pdir_inode, const char *name,
+                      struct ext2_dir_entry **dent) {
+    int name_len;
+    struct ext2_dir_entry *dir;
+    int n_block;
+
+    name_len = strlen(name);
+
+    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
+        dir = locate_meta_block(n_block);
+        for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
+             len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+            STAT_INC(dents_visited);
+            if (dir->inode != 0 && dir->name_len == name_len &&
+                !strncmp(name, dir->name, name_len)) {
+                *dent = dir;
+                return dir->inode;
+            }
+        }
+    }
+
+    return -1;
+}
+
+int find_dent_dir_by_path(const struct path_tokens *pt) {
+    int type;
+    int n_inode;
+    n_inode = resolve_path(pt, 1, 0, &type);
+    return n_inode < 0 ? -1 : (type == EXT2_FT_DIR ? n_inode : -1);
+}
+
+int find_dent_any_by_path(const struct path_tokens *pt) {
+    int type;
+    return find_dent_by_path(pt, &type);
+}
+
+int find_dent_by_path(const struct path_tokens *pt, int *type) {
+    return resolve_path(pt, 0, 0, type);
+}
+
+/*
+ * Walk pt from the root. Symlinks met before the last token are always
+ * followed; the last token is followed only if follow is set. Directory
+ * prefixes that resolve are remembered in the path cache, so a later walk
+ * under the same (possibly symlinked) directory starts from there.
+ */
+int resolve_path(const struct path_tokens *pt, int follow, int depth,
+                 int *type) {
+    struct ext2_dir_entry *dir;
+    int n_inode;
+    int start;
+    char key[PATH_MAX];
+
+    TRACE_BEGIN(TRACE_RESOLVE);
+    STAT_INC(paths_resolved);
+    n_inode = EXT2_ROOT_INO;
+    *type = EXT2_FT_DIR;
+    start = 0;
+
+    for (int i = follow ? pt->num : pt->num - 1; i > 0; --i) {
+        make_path_key(pt, i, key);
+        if ((n_inode = lookup_path_cache(key, type)) > 0) {
+            start = i;
+            break;
+        }
+        n_inode = EXT2_ROOT_INO;
+    }
+
+    for (int i = start; i < pt->num; ++i) {
+        if (*type != EXT2_FT_DIR) {
+            TRACE_END(TRACE_RESOLVE);
+            return -1;
+        }
+        if ((n_inode = find_dent_by_name(n_inode, pt->tokens[i], &dir)) < 0) {
+            TRACE_END(TRACE_RESOLVE);
+            return -1;
+        }
+        *type = get_dent_type(dir);
+        if (*type == EXT2_FT_SYMLINK && (follow || i < pt->num - 1)) {
+            if ((n_inode = follow_symlink(n_inode, pt, i, depth, type)) < 0) {
+                TRACE_END(TRACE_RESOLVE);
+                return -1;
+            }
+        }
+        if (*type == EXT2_FT_DIR) {
+            make_path_key(pt, i + 1, key);
+            insert_path_cache(key, n_inode, *type);
+        }
+    }
+
+    TRACE_END(TRACE_RESOLVE);
+    return n_inode;
+}
+
+/*
+ * Resolve the symlink n_inode found at pt->tokens[i]. Relative targets are
+ * taken from the directory holding the link, i.e. pt->tokens[0..i-1].
+ */
+int follow_symlink(int n_inode, const struct path_tokens *pt, int i,
+                   int depth, int *type) {
+    char target[EXT2_BLOCK_SIZE + 1];
+    struct path_tokens *target_pt, *rel_pt;
+
+    if (depth >= MAX_SYMLINK_DEPTH) {
+        fprintf(stderr, "too many levels of symbolic links\n");
+        exit(ELOOP);
+    }
+
+    read_symlink(n_inode, target);
+    target_pt = create_path_tokens(target);
+    if (target[0] != '/') {
+        rel_pt = target_pt;
+        target_pt = create_path_tokens("/");
+        for (int j = 0; j < i; ++j) {
+            add_path_token(target_pt, pt->tokens[j]);
+        }
+        for (int j = 0; j < rel_pt->num; ++j) {
+            add_path_token(target_pt, rel_pt->tokens[j]);
+        }
+        destroy_path_tokens(rel_pt);
+    }
+
+    n_inode = resolve_path(target_pt, 1, depth + 1, type);
+
+    destroy_path_tokens(target_pt);
+
+    return n_inode;
+}
+
+int read_symlink(int n_inode, char *target) {
+    struct ext2_inode *inode;
+    int len;
+
+    inode = locate_inode(n_inode);
+    len = MIN(inode->i_size, EXT2_BLOCK_SIZE);
+
+    if (is_inode_fastsym(n_inode)) {
+        memcpy(target, inode->i_block, len);
+    } else {
+        memcpy(target, locate_block(find_block_linear(n_inode, 0)), len);
+    }
+    target[len] = '\0';
+
+    return len;
+}
+
+/* ------------------- resolved path cache ------------------- */
+
+unsigned int hash_path_key(const char *key) {
+    unsigned int hash = 2166136261U;
+    for (; *key; ++key) {
+        hash = (hash ^ (unsigned char)*key) * 16777619U;
+    }
+    return hash;
+}
+
+void make_path_key(const struct path_tokens *pt, int num, char *key) {
+    int len = 0;
+    for (int i = 0; i < num && len < PATH_MAX - 1; ++i) {
+        len += snprintf(key + len, PATH_MAX - len, "/%s", pt->tokens[i]);
+    }
+    key[MIN(len, PATH_MAX - 1)] = '\0';
+}
+
+int lookup_path_cache(const char *key, int *type) {
+    struct path_cache_entry *e;
+
+    e = &path_cache[hash_path_key(key) % PATH_CACHE_SIZE];
+    if (e->key && !strcmp(e->key, key)) {
+        *type = e->type;
+        return e->n_inode;
+    }
+
+    return -1;
+}
+
+void insert_path_cache(const char *key, int n_inode, int type) {
+    struct path_cache_entry *e;
+
+    e = &path_cache[hash_path_key(key) % PATH_CACHE_SIZE];
+    free(e->key);
+    if (!(e->key = strdup(key))) {
+        perror("strdup");
+        exit(ENOMEM);
+    }
+    e->n_inode = n_inode;
+    e->type = type;
+}
+
+void clear_path_cache() {
+    for (int i = 0; i < PATH_CACHE_SIZE; ++i) {
+        free(path_cache[i].key);
+        path_cache[i].key = NULL;
+    }
+}
+
+struct ext2_dir_entry *find_deleteddent_helper(int n_pdir_inode,
+                                               const char *name,
+                                               struct ext2_dir_entry **prev_dir,
+                                               int *rec_len,
+                                               int *n_dent_block) {
+    int name_len;
+    int dir_entry_len;
+    struct ext2_dir_entry *dir, *try_dir;
+    int min_rec_len, extra_len;
+    int n_block;
+
+    name_len = strlen(name);
+    dir_entry_len = sizeof(struct ext2_dir_entry) + get_name_len(name);
+
+    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
+        dir = locate_meta_block(n_block);
+        for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
+             len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+            *prev_dir = try_dir = dir;
+            for (int _len = 0; _len < dir->rec_len && try_dir->rec_len != 0 &&
+                               try_dir->name_len != 0;) {
+                min_rec_len = sizeof(struct ext2_dir_entry) +
+                              padding_name_len(try_dir->name_len);
+                try_dir = offset_ptr(try_dir, min_rec_len);
+                _len += min_rec_len;
+                extra_len = dir->rec_len - _len;
+                if (extra_len < dir_entry_len) {
+                    break;
+                }
+                if (try_dir->inode != 0 && try_dir->rec_len >= dir_entry_len &&
+                    try_dir->name_len == name_len &&
+                    !strncmp(try_dir->name, name, name_len)) {
+                    *rec_len = extra_len;
+                    *n_dent_block = n_block;
+                    return try_dir;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int find_deleteddent(int n_pdir_inode, const char *name, int *type) {
+    int rec_len;
+    int n_block;
+    struct ext2_dir_entry *dir, *prev_dir;
+
+    if (!(dir = find_deleteddent_helper(n_pdir_inode, name, &prev_dir,
+                                        &rec_len, &n_block))) {
+        return -1;
+    }
+
+    *type = get_dent_type(dir);
+
+    return dir->inode;
+}
+
+void restore_deleteddent(int n_pdir_inode, const char *name) {
+    int rec_len;
+    int n_block;
+    struct ext2_dir_entry *dir, *prev_dir;
+    struct ext2_inode *inode;
+
+    if (!(dir = find_deleteddent_helper(n_pdir_inode, name, &prev_dir,
+                                        &rec_len, &n_block))) {
+        return;
+    }
+
+    prev_dir->rec_len = calc_offset_ptr(dir, prev_dir);
+    dir->rec_len = rec_len;
+    mark_block_dirty(n_block);
+    drop_dir_gaps(n_pdir_inode);
+
+    inode = locate_inode(dir->inode);
+    ++inode->i_links_count;
+    mark_inode_dirty(dir->inode);
+}
+
+/* ------------------- directory free-space summary ------------------- */
+
+struct dir_gaps *get_dir_gaps(int n_pdir_inode) {
+    struct dir_gaps *dg;
+    int n_block;
+
+    dg = &dir_gaps_cache[n_pdir_inode % DIR_GAPS_CACHE_SIZE];
+    if (dg->n_inode == n_pdir_inode) {
+        return dg;
+    }
+
+    drop_dir_gaps(dg->n_inode);
+    dg->n_inode = n_pdir_inode;
+    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
+        update_dir_gaps(n_pdir_inode, n_block);
+    }
+
+    return dg;
+}
+
+int calc_block_gap(int n_block) {
+    struct ext2_dir_entry *dir;
+    int gap, min_rec_len;
+
+    gap = 0;
+    dir = locate_meta_block(n_block);
+
+    for (int len = 0; len < EXT2_BLOCK_SIZE;
+         len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+        if (dir->rec_len == 0) {
+            gap = MAX(gap, EXT2_BLOCK_SIZE - len);
+            break;
+        }
+        if (dir->inode == 0) {
+            min_rec_len = 0;
+        } else {
+            min_rec_len = sizeof(struct ext2_dir_entry) +
+                          padding_name_len(dir->name_len);
+        }
+        gap = MAX(gap, dir->rec_len - min_rec_len);
+    }
+
+    return gap;
+}
+
+/* Refresh the entry of n_block, appending it if the directory just grew. */
+void update_dir_gaps(int n_pdir_inode, int n_block) {
+    struct dir_gaps *dg;
+    int i;
+
+    dg = &dir_gaps_cache[n_pdir_inode % DIR_GAPS_CACHE_SIZE];
+    if (dg->n_inode != n_pdir_inode) {
+        return;
+    }
+
+    for (i = 0; i < dg->num && dg->blocks[i] != n_block; ++i)
+        ;
+    if (i == dg->num) {
+        ++dg->num;
+        if (!(dg->blocks = realloc(dg->blocks, sizeof(int) * dg->num)) ||
+            !(dg->gaps = realloc(dg->gaps, sizeof(int) * dg->num))) {
+            perror("realloc");
+            exit(ENOMEM);
+        }
+        dg->blocks[i] = n_block;
+    }
+    dg->gaps[i] = calc_block_gap(n_block);
+
+    if (dg->gaps[i] >= dg->gaps[dg->max]) {
+        dg->max = i;
+    } else if (i == dg->max) {
+        for (int j = 0; j < dg->num; ++j) {
+            if (dg->gaps[j] > dg->gaps[dg->max]) {
+                dg->max = j;
+            }
+        }
+    }
+}
+
+void drop_dir_gaps(int n_pdir_inode) {
+    struct dir_gaps *dg;
+
+    dg = &dir_gaps_cache[n_pdir_inode % DIR_GAPS_CACHE_SIZE];
+    if (dg->n_inode != n_pdir_inode) {
+        return;
+    }
+
+    free(dg->blocks);
+    free(dg->gaps);
+    memset(dg, 0, sizeof(struct dir_gaps));
+}
+
+void clear_dir_gaps() {
+    for (int i = 0; i < DIR_GAPS_CACHE_SIZE; ++i) {
+        drop_dir_gaps(dir_gaps_cache[i].n_inode);
+    }
+}
+
+/* ------------------- compact directory ------------------- */
+
+struct dent_chunk *collect_dent_chunks(int n_dir_inode, int flags, int *num) {
+    struct dent_chunk *chunks;
+    struct ext2_dir_entry *dir, *try_dir;
+    int n_block;
+    int min_rec_len, len;
+
+    chunks = NULL;
+    *num = 0;
+
+    for (int i = 0; (n_block = find_block_linear(n_dir_inode, i)); ++i) {
+        dir = locate_meta_block(n_block);
+        for (int off = 0; off < EXT2_BLOCK_SIZE && dir->rec_len != 0;
+             off += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+            if (dir->inode == 0) {
+                continue;
+            }
+            len = sizeof(struct ext2_dir_entry) +
+                  padding_name_len(dir->name_len);
+            if (flags & COMPACT_KEEP_DELETED) {
+                try_dir = offset_ptr(dir, len);
+                while (len < dir->rec_len && try_dir->rec_len != 0 &&
+                       try_dir->name_len != 0 && try_dir->inode != 0 &&
+                       try_dir->inode <= sb->s_inodes_count) {
+                    min_rec_len = sizeof(struct ext2_dir_entry) +
+                                  padding_name_len(try_dir->name_len);
+                    if (len + min_rec_len > dir->rec_len ||
+                        chk_inodebit(try_dir->inode)) {
+                        break;
+                    }
+                    len += min_rec_len;
+                    try_dir = offset_ptr(try_dir, min_rec_len);
+                }
+            }
+
+            ++*num;
+            if (!(chunks = realloc(chunks, sizeof(struct dent_chunk) * *num))) {
+                perror("realloc");
+                exit(ENOMEM);
+            }
+            if (!(chunks[*num - 1].data = malloc(len))) {
+                perror("malloc");
+                exit(ENOMEM);
+            }
+            memcpy(chunks[*num - 1].data, dir, len);
+            chunks[*num - 1].len = len;
+        }
+    }
+
+    return chunks;
+}
+
+int cmp_dent_chunk(const void *a, const void *b) {
+    const struct ext2_dir_entry *dir_a, *dir_b;
+    int cmp;
+
+    dir_a = (const void *)((const struct dent_chunk *)a)->data;
+    dir_b = (const void *)((const struct dent_chunk *)b)->data;
+    cmp = strncmp(dir_a->name, dir_b->name,
+                  MIN(dir_a->name_len, dir_b->name_len));
+
+    return cmp ? cmp : dir_a->name_len - dir_b->name_len;
+}
+
+/*
+ * Repack the live entries of a directory from its first block on and free
+ * the blocks left empty at the tail. Inode numbers never change; with
+ * COMPACT_KEEP_DELETED the restorable entries travel with the live entry
+ * whose slack hides them, so ext2_restore still finds them.
+ */
+int compact_dir_inode(int n_dir_inode, int flags) {
+    struct ext2_inode *dir_inode;
+    struct dent_chunk *chunks;
+    struct ext2_dir_entry *dir, *last_dir, *try_dir;
+    int num, n_old_blocks, n_new_blocks;
+    int i_block, off, min_rec_len;
+    int n_block;
+    unsigned char *block;
+    int cnt;
+
+    dir_inode = locate_inode(n_dir_inode);
+    chunks = collect_dent_chunks(n_dir_inode, flags, &num);
+    n_old_blocks = count_blocks(n_dir_inode);
+    cnt = 0;
+
+    if (flags & COMPACT_SORT && num > 2) {
+        qsort(chunks + 2, num - 2, sizeof(struct dent_chunk), cmp_dent_chunk);
+    }
+
+    i_block = 0;
+    off = 0;
+    last_dir = NULL;
+    n_block = find_block_linear(n_dir_inode, 0);
+    block = locate_meta_block(n_block);
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    mark_block_dirty(n_block);
+
+    for (int i = 0; i < num; ++i) {
+        if (off + chunks[i].len > EXT2_BLOCK_SIZE) {
+            last_dir->rec_len += EXT2_BLOCK_SIZE - off;
+            n_block = find_block_linear(n_dir_inode, ++i_block);
+            block = locate_meta_block(n_block);
+            memset(block, 0, EXT2_BLOCK_SIZE);
+            mark_block_dirty(n_block);
+            off = 0;
+        }
+        memcpy(block + off, chunks[i].data, chunks[i].len);
+        last_dir = dir = (void *)(block + off);
+        min_rec_len =
+            sizeof(struct ext2_dir_entry) + padding_name_len(dir->name_len);
+        dir->rec_len = chunks[i].len;
+        for (int len = min_rec_len; len < chunks[i].len; len += min_rec_len) {
+            try_dir = offset_ptr(dir, len);
+            min_rec_len = sizeof(struct ext2_dir_entry) +
+                          padding_name_len(try_dir->name_len);
+            try_dir->rec_len = min_rec_len;
+        }
+        off += chunks[i].len;
+        free(chunks[i].data);
+    }
+    if (last_dir) {
+        last_dir->rec_len += EXT2_BLOCK_SIZE - off;
+    }
+    free(chunks);
+
+    n_new_blocks = i_block + 1;
+    if (n_new_blocks < n_old_blocks) {
+        truncate_blocks(n_dir_inode, n_new_blocks);
+        dir_inode->i_size = n_new_blocks * EXT2_BLOCK_SIZE;
+        mark_inode_dirty(n_dir_inode);
+        printf("Compacted: directory inode [%d] from %d to %d blocks\n",
+               n_dir_inode, n_old_blocks, n_new_blocks);
+        cnt += n_old_blocks - n_new_blocks;
+    }
+    drop_dir_gaps(n_dir_inode);
+
+    if (flags & COMPACT_RECURSIVE) {
+        for (int i = 0; (n_block = find_block_linear(n_dir_inode, i)); ++i) {
+            dir = locate_meta_block(n_block);
+            for (off = 0; off < EXT2_BLOCK_SIZE && dir->rec_len != 0;
+                 off += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
+                if (dir->inode == 0 || !is_dent_dir(dir) ||
+                    (dir->name_len == 1 && !strncmp(dir->name, ".", 1)) ||
+                    (dir->name_len == 2 && !strncmp(dir->name, "..", 2))) {
+                    continue;
+                }
+                /* lost+found keeps its preallocated blocks for fsck */
+                if (n_dir_inode == EXT2_ROOT_INO && dir->name_len == 10 &&
+                    !strncmp(dir->name, "lost+found", 10)) {
+                    continue;
+                }
+                cnt += compact_dir_inode(dir->inode, flags);
+            }
+        }
+    }
+
+    return cnt;
+}
+
+/* ------------------- metadata capture ------------------- */
+
+int cb_capture_inode(struct ext2_dir_entry *dent) {
+    if (dent->inode >= 1 && dent->inode <= sb->s_inodes_count) {
+        capture_inode(dent->inode);
+    }
+    return 0;
+}
+
+/* Superblock and descriptor backups, bitmaps and inode table of a group. */
+void capture_group(int n_group) {
+    struct ext2_group_desc *bg;
+    int n_first, n_inode_tbl_blocks;
+
+    bg = locate_group(n_group);
+    n_first = sb->s_first_data_block + n_group * sb->s_blocks_per_group;
+    if (group_has_super(n_group)) {
+        for (int i = 0; i <= count_gdt_blocks(); ++i) {
+            set_bit(n_first + i, capture_map);
+        }
+    }
+    set_bit(bg->bg_block_bitmap, capture_map);
+    set_bit(bg->bg_inode_bitmap, capture_map);
+    n_inode_tbl_blocks =
+        sb->s_inodes_per_group * sizeof(struct ext2_inode) / EXT2_BLOCK_SIZE;
+    for (int i = 0; i < n_inode_tbl_blocks; ++i) {
+        set_bit(bg->bg_inode_table + i, capture_map);
+    }
+}
+
+/* Mark the indirect blocks, and every block unless it holds file data. */
+void capture_inode(int n_inode) {
+    struct ext2_inode *inode;
+    unsigned int *map;
+    int n_block;
+
+    if (chk_bit(n_inode - 1, capture_seen)) {
+        return;
+    }
+    set_bit(n_inode - 1, capture_seen);
+
+    inode = locate_inode(n_inode);
+    if (is_inode_fastsym(n_inode)) {
+        /* i_block[] holds the target text, not block numbers */
+        return;
+    }
+    if (inode->i_block[12] && inode->i_block[12] < count_blockio_blocks()) {
+        set_bit(inode->i_block[12], capture_map);
+    }
+    /* only the journal is large enough to go double indirect */
+    if (n_inode == sb->s_journal_inum && inode->i_block[13] &&
+        inode->i_block[13] < count_blockio_blocks()) {
+        set_bit(inode->i_block[13], capture_map);
+        map = locate_meta_block(inode->i_block[13]);
+        for (int i = 0; i < EXT2_BLOCK_SIZE / 4; ++i) {
+            if (map[i] && map[i] < count_blockio_blocks()) {
+                set_bit(map[i], capture_map);
+            }
+        }
+    }
+    if (!is_inode_dir(n_inode) && n_inode != sb->s_journal_inum &&
+        !is_inode_sym(n_inode)) {
+        return;
+    }
+    for (int i = 0; (n_block = find_block_linear(n_inode, i)); ++i) {
+        if (n_block < count_blockio_blocks()) {
+            set_bit(n_block, capture_map);
+        }
+    }
+}
+
+/* Copy the runs in capture_map into a new sparse file of the same size. */
+int write_captured_blocks(const char *filename) {
+    char *buf;
+    int fd, n_run, n_captured, zero;
+    size_t len;
+
+    if (!(buf = malloc(PACK_CHUNK_BLOCKS * EXT2_BLOCK_SIZE))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        perror(filename);
+        exit(EEXIST);
+    }
+    if (ftruncate(fd, (off_t)count_blockio_blocks() * EXT2_BLOCK_SIZE) != 0) {
+        perror("ftruncate");
+        exit(EIO);
+    }
+
+    n_captured = 0;
+    for (int i = 0; i < count_blockio_blocks();) {
+        if (!chk_bit(i, capture_map)) {
+            ++i;
+            continue;
+        }
+        for (n_run = 0; i + n_run < count_blockio_blocks() &&
+                        chk_bit(i + n_run, capture_map) &&
+                        n_run < PACK_CHUNK_BLOCKS;
+             ++n_run)
+            ;
+        read_raw_blocks(i, n_run, buf);
+        STAT_ADD(bytes_copied, n_run * EXT2_BLOCK_SIZE);
+        /* never-written inode tables stay holes in the copy too */
+        for (int j = 0, k; j < n_run; j = k) {
+            zero = is_zero_block(buf + j * EXT2_BLOCK_SIZE);
+            for (k = j + 1; k < n_run &&
+                            is_zero_block(buf + k * EXT2_BLOCK_SIZE) == zero;
+                 ++k)
+                ;
+            len = (size_t)(k - j) * EXT2_BLOCK_SIZE;
+            if (!zero &&
+                pwrite(fd, buf + j * EXT2_BLOCK_SIZE, len,
+                       (off_t)(i + j) * EXT2_BLOCK_SIZE) != len) {
+                perror("pwrite");
+                exit(EIO);
+            }
+        }
+        n_captured += n_run;
+        i += n_run;
+    }
+    if (fsync(fd) != 0) {
+        perror("fsync");
+        exit(EIO);
+    }
+    close(fd);
+    free(buf);
+
+    return n_captured;
+}
+
+int is_zero_block(const char *block) {
+    return !block[0] && !memcmp(block, block + 1, EXT2_BLOCK_SIZE - 1);
+}
+
+/* ------------------- recursive import ------------------- */
+
+/* Append src as an entry under parent, then its children in name order. */
+void collect_import(const char *src, const char *name, int parent) {
+    struct import_entry *e;
+    struct stat st;
+    struct dirent **children;
+    char *path;
+    int num, self;
+
+    if (lstat(src, &st) != 0) {
+        perror(src);
+        exit(ENOENT);
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file or directory, skipped\n",
+                src);
+        return;
+    }
+    if (strlen(name) > EXT2_NAME_LEN) {
+        fprintf(stderr, "%s: file name too long\n", src);
+        exit(ENAMETOOLONG);
+    }
+    /* fail before anything is written, not halfway through the tree */
+    if (S_ISREG(st.st_mode) &&
+        st.st_size > (off_t)(12 + EXT2_BLOCK_SIZE / 4) * EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "%s: file too large\n", src);
+        exit(EFBIG);
     }
 
-    return n_block;
+    if (import_num == import_max) {
+        import_max = import_max ? import_max * 2 : 256;
+        if (!(import_entries = realloc(
+                  import_entries, import_max * sizeof(struct import_entry)))) {
+            perror("realloc");
+            exit(ENOMEM);
+        }
+    }
+    self = import_num++;
+    e = &import_entries[self];
+    memset(e, 0, sizeof(struct import_entry));
+    if (!(e->src = strdup(src)) || !(e->name = strdup(name))) {
+        perror("strdup");
+        exit(ENOMEM);
+    }
+    e->parent = parent;
+    e->is_dir = S_ISDIR(st.st_mode);
+    if (!e->is_dir) {
+        return;
+    }
+
+    if ((num = scandir(src, &children, NULL, alphasort)) < 0) {
+        perror(src);
+        exit(EIO);
+    }
+    for (int i = 0; i < num; ++i) {
+        if (strcmp(children[i]->d_name, ".") &&
+            strcmp(children[i]->d_name, "..")) {
+            if (asprintf(&path, "%s/%s", src, children[i]->d_name) < 0) {
+                perror("asprintf");
+                exit(ENOMEM);
+            }
+            collect_import(path, children[i]->d_name, self);
+            free(path);
+        }
+        free(children[i]);
+    }
+    free(children);
 }
 
-int find_block_lastused(int n_inode) {
+/* Read files in entry order, at most IMPORT_WINDOW ahead of the writer. */
+void *import_reader(void *arg) {
+    struct import_entry *e;
+
+    for (;;) {
+        pthread_mutex_lock(&import_lock);
+        for (;;) {
+            if (import_next_read < import_num &&
+                import_entries[import_next_read].is_dir) {
+                ++import_next_read;
+            } else if (import_next_read < import_num &&
+                       import_next_read >= import_next_write + IMPORT_WINDOW) {
+                pthread_cond_wait(&import_cond, &import_lock);
+            } else {
+                break;
+            }
+        }
+        if (import_next_read == import_num) {
+            pthread_mutex_unlock(&import_lock);
+            return NULL;
+        }
+        e = &import_entries[import_next_read++];
+        pthread_mutex_unlock(&import_lock);
+
+        read_import_file(e - import_entries);
+
+        pthread_mutex_lock(&import_lock);
+        e->ready = 1;
+        pthread_cond_broadcast(&import_cond);
+        pthread_mutex_unlock(&import_lock);
+    }
+}
+
+/* Whole file into e->data; failures are left in e->err for the writer. */
+void read_import_file(int i) {
+    struct import_entry *e = &import_entries[i];
+    struct stat st;
+    ssize_t n = 0;
+    int fd;
+
+    if ((fd = open(e->src, O_RDONLY)) < 0) {
+        e->err = errno;
+        return;
+    }
+    if (fstat(fd, &st) != 0) {
+        e->err = errno;
+    } else if (!(e->data = malloc(st.st_size ? st.st_size : 1))) {
+        e->err = ENOMEM;
+    } else {
+        while (e->len < st.st_size &&
+               (n = read(fd, e->data + e->len, st.st_size - e->len)) > 0) {
+            e->len += n;
+        }
+        if (n < 0) {
+            e->err = errno;
+        }
+    }
+    close(fd);
+}
+
+void write_reg_data(int n_inode, const unsigned char *data, long len) {
     struct ext2_inode *inode;
+    unsigned char *block;
     int n_block;
-    int is_found;
-    unsigned int *block;
+
+    TRACE_BEGIN(TRACE_COPY);
+    for (long off = 0; off < len; off += EXT2_BLOCK_SIZE) {
+        n_block = alloc_block_any(n_inode);
+        block = locate_new_block(n_block);
+        memcpy(block, data + off, MIN(len - off, EXT2_BLOCK_SIZE));
+        STAT_ADD(bytes_copied, MIN(len - off, EXT2_BLOCK_SIZE));
+        mark_block_dirty(n_block);
+        put_block(n_block);
+    }
+    TRACE_END(TRACE_COPY);
 
     inode = locate_inode(n_inode);
+    inode->i_size = len;
+    inode->i_dtime = 0;
+    mark_inode_dirty(n_inode);
+}
 
-    for (int i = 1; i < 13; ++i) {
-        if (!inode->i_block[i]) {
-            n_block = inode->i_block[i - 1];
-            is_found = 1;
-            break;
+/* ------------------- extract ------------------- */
+
+/* Make directories and symlinks under dst now, queue regular files. */
+void collect_extract(int n_inode, const char *dst) {
+    char target[EXT2_BLOCK_SIZE + 1];
+    char *path, **names;
+    int *children;
+    int num;
+
+    if (is_inode_reg(n_inode)) {
+        add_extract_job(n_inode, dst);
+    } else if (is_inode_sym(n_inode)) {
+        read_symlink(n_inode, target);
+        if ((unlink(dst) != 0 && errno != ENOENT) ||
+            symlink(target, dst) != 0) {
+            perror(dst);
+            exit(EIO);
         }
-    }
+        ++extract_syms;
+    } else if (is_inode_dir(n_inode)) {
+        /* owner write, so the tree can be filled in whatever the mode */
+        if (mkdir(dst, get_inode_perms(n_inode) | 0700) != 0 &&
+            errno != EEXIST) {
+            perror(dst);
+            exit(EIO);
+        }
+        ++extract_dirs;
 
-    if (!is_found) {
-        block = locate_block(inode->i_block[12]);
-        for (int i = 1; i < EXT2_BLOCK_SIZE / 4; ++i) {
-            if (!block[i]) {
-                n_block = block[i - 1];
-                break;
+        num = list_dents(n_inode, &children, &names);
+        release_blocks();
+
+        for (int i = 0; i < num; ++i) {
+            if (asprintf(&path, "%s/%s", dst, names[i]) < 0) {
+                perror("asprintf");
+                exit(ENOMEM);
             }
+            collect_extract(children[i], path);
+            free(path);
+            free(names[i]);
         }
+        free(children);
+        free(names);
     }
+}
 
-    return n_block;
+/* Queue dst with the block runs of n_inode; holes get no run. */
+void add_extract_job(int n_inode, const char *dst) {
+    struct ext2_inode *inode;
+    struct extract_job *job;
+    struct extract_run *run;
+    int n_block, n_file_blocks;
+
+    inode = locate_inode(n_inode);
+
+    if (extract_num == extract_max) {
+        extract_max = extract_max ? extract_max * 2 : 256;
+        if (!(extract_jobs = realloc(
+                  extract_jobs, extract_max * sizeof(struct extract_job)))) {
+            perror("realloc");
+            exit(ENOMEM);
+        }
+    }
+    job = &extract_jobs[extract_num++];
+    memset(job, 0, sizeof(struct extract_job));
+    if (!(job->dst = strdup(dst))) {
+        perror("strdup");
+        exit(ENOMEM);
+    }
+    job->mode = get_inode_perms(n_inode);
+    job->size = inode->i_size;
+
+    n_file_blocks = (job->size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if (!(job->runs = malloc(MAX(n_file_blocks, 1) *
+                             sizeof(struct extract_run)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    run = NULL;
+    for (int i = 0; i < n_file_blocks; ++i) {
+        if (!(n_block = find_block_linear(n_inode, i))) {
+            continue;
+        }
+        if (run && run->index + run->num == i &&
+            run->n_block + run->num == n_block) {
+            ++run->num;
+        } else {
+            run = &job->runs[job->n_runs++];
+            run->index = i;
+            run->n_block = n_block;
+            run->num = 1;
+        }
+    }
 }
 
-/* ------------------- manipulate dir_entry ------------------- */
+void *extract_worker(void *arg) {
+    char *buf;
+    int i;
 
-void add_dent_dir(int n_inode, int n_pdir_inode, const char *name) {
-    add_dent(n_inode, n_pdir_inode, name, EXT2_FT_DIR);
+    if (!(buf = malloc(PACK_CHUNK_BLOCKS * EXT2_BLOCK_SIZE))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    for (;;) {
+        pthread_mutex_lock(&extract_lock);
+        i = extract_next < extract_num ? extract_next++ : -1;
+        pthread_mutex_unlock(&extract_lock);
+        if (i < 0) {
+            break;
+        }
+        write_extract_job(i, buf);
+    }
+    free(buf);
+    return NULL;
 }
-void add_dent_reg(int n_inode, int n_pdir_inode, const char *name) {
-    add_dent(n_inode, n_pdir_inode, name, EXT2_FT_REG_FILE);
+
+/*
+ * Each run goes out in one pwrite straight from the mapping, or through
+ * buf in PACK_CHUNK_BLOCKS pieces for the buffered backends. Holes are
+ * left to ftruncate().
+ */
+void write_extract_job(int i, char *buf) {
+    struct extract_job *job = &extract_jobs[i];
+    struct extract_run *run;
+    const void *map;
+    off_t off;
+    long len;
+    int fd, num;
+
+    if ((fd = open(job->dst, O_WRONLY | O_CREAT | O_TRUNC, job->mode)) < 0) {
+        perror(job->dst);
+        exit(EIO);
+    }
+    for (int r = 0; r < job->n_runs; ++r) {
+        run = &job->runs[r];
+        off = (off_t)run->index * EXT2_BLOCK_SIZE;
+        len = MIN((long)run->num * EXT2_BLOCK_SIZE, job->size - off);
+        if ((map = map_raw_blocks(run->n_block))) {
+            pwrite_all(fd, map, len, off, job->dst);
+            continue;
+        }
+        for (int j = 0; j < run->num; j += num) {
+            num = MIN(run->num - j, PACK_CHUNK_BLOCKS);
+            read_raw_blocks(run->n_block + j, num, buf);
+            pwrite_all(fd, buf,
+                       MIN((long)num * EXT2_BLOCK_SIZE,
+                           len - (long)j * EXT2_BLOCK_SIZE),
+                       off + (off_t)j * EXT2_BLOCK_SIZE, job->dst);
+        }
+    }
+    if (ftruncate(fd, job->size) != 0 || close(fd) != 0) {
+        perror(job->dst);
+        exit(EIO);
+    }
 }
-void add_dent_sym(int n_inode, int n_pdir_inode, const char *name) {
-    add_dent(n_inode, n_pdir_inode, name, EXT2_FT_SYMLINK);
+
+void pwrite_all(int fd, const void *buf, size_t len, off_t off,
+                const char *dst) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = pwrite(fd, buf, len, off)) < 0) {
+            perror(dst);
+            exit(EIO);
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+        off += n;
+    }
 }
 
-void init_dent(struct ext2_dir_entry *dir, unsigned int n_inode,
-               unsigned short rec_len, unsigned char name_len,
-               unsigned char file_type, const char *name) {
-    // memset(dir, 0, rec_len);
-    dir->inode = n_inode;
-    dir->rec_len = rec_len;
-    dir->name_len = name_len;
-    dir->file_type = file_type;
-    strncpy(dir->name, name, name_len);
+/* ------------------- tar ------------------- */
+
+/*
+ * Parent inode of the new path, which must not exist yet; *pt gets the
+ * path's tokens for the caller to destroy.
+ */
+int find_new_parent(const char *path, struct path_tokens **pt) {
+    int n_pdir_inode;
+    struct path_tokens *pdir_pt;
+
+    *pt = create_path_tokens(path);
+    pdir_pt = create_path_tokens(path);
+    pop_path_token(pdir_pt);
+
+    if ((n_pdir_inode = find_dent_dir_by_path(pdir_pt)) < 0) {
+        fprintf(stderr, "parent directory of %s not found\n", path);
+        exit(ENOENT);
+    }
+    if (find_dent_any_by_path(*pt) > 0) {
+        fprintf(stderr, "%s already exists\n", path);
+        exit(EEXIST);
+    }
+    destroy_path_tokens(pdir_pt);
+    return n_pdir_inode;
 }
 
-void add_dent(int n_inode, int n_pdir_inode, const char *name, int type) {
-    struct ext2_inode *inode;
-    int n_block;
-    int added;
+/*
+ * The image path of archive member name under dst_dir, or NULL for the
+ * archive root and for names with a .. component, which are skipped.
+ */
+char *make_tar_path(const char *dst_dir, const char *name) {
+    char *rel, *path, *token, *save;
+    int len;
 
-    inode = locate_inode(n_inode);
-    n_block = find_block_lastused(n_pdir_inode);
-    added = 0;
+    while (*name == '/' || (name[0] == '.' && name[1] == '/')) {
+        name += *name == '/' ? 1 : 2;
+    }
+    if (!strcmp(name, ".")) {
+        name = "";
+    }
+    for (len = strlen(name); len > 0 && name[len - 1] == '/'; --len) {
+    }
+    if (len == 0) {
+        return NULL;
+    }
 
-    if (add_dent_in_block(n_inode, n_pdir_inode, name, type, n_block) < 0) {
-        n_block = alloc_block_any(n_pdir_inode);
-        if (!add_dent_in_block(n_inode, n_pdir_inode, name, type, n_block)) {
-            added = 1;
+    if (!(rel = strndup(name, len))) {
+        perror("strndup");
+        exit(ENOMEM);
+    }
+    for (token = strtok_r(rel, "/", &save); token;
+         token = strtok_r(NULL, "/", &save)) {
+        if (!strcmp(token, "..")) {
+            fprintf(stderr, "%s: leaves the archive, skipped\n", name);
+            free(rel);
+            return NULL;
         }
-    } else {
-        added = 1;
     }
+    free(rel);
 
-    if (added) {
-        ++inode->i_links_count;
+    if (asprintf(&path, "%s%s%.*s", dst_dir,
+                 dst_dir[strlen(dst_dir) - 1] == '/' ? "" : "/", len,
+                 name) < 0) {
+        perror("asprintf");
+        exit(ENOMEM);
     }
+    return path;
 }
 
-int add_dent_in_block(int n_inode, int n_pdir_inode, const char *name, int type,
-                      int n_block) {
-    int name_len;
-    int dir_entry_len;
-    struct ext2_dir_entry *dir;
-    int min_rec_len, extra_len;
-    int ret;
+/* Data of a GNU long name entry, padding included. */
+char *read_tar_string(struct stream *st, long size) {
+    char *str;
 
-    name_len = strlen(name);
-    dir_entry_len = sizeof(struct ext2_dir_entry) + get_name_len(name);
-    ret = -1;
+    if (size < 0 || size > PATH_MAX) {
+        fprintf(stderr, "invalid tar header\n");
+        exit(EINVAL);
+    }
+    if (!(str = malloc(size + 1))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    stream_get(st, str, size);
+    str[size] = '\0';
+    skip_tar_data(st, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    return str;
+}
 
-    dir = locate_block(n_block);
+/* pax extended header: "<len> <key>=<value>\n" records, path and linkpath. */
+void read_pax_header(struct stream *st, long size, char **name, char **link) {
+    char *data, *rec, *key, *value;
+    long len;
 
-    for (int len = 0; len < EXT2_BLOCK_SIZE;
-         len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
-        if (dir->rec_len == 0) {
-            extra_len = EXT2_BLOCK_SIZE - len;
-            if (extra_len >= dir_entry_len) {
-                init_dent(dir, n_inode, extra_len, name_len, type, name);
-                ret = 0;
-            }
-            break;
+    if (size > 64 * TAR_BLOCK) {
+        /* only huge xattrs get this long, nothing we keep */
+        skip_tar_data(st, (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK);
+        return;
+    }
+    data = read_tar_string(st, size);
+    for (rec = data; rec < data + size; rec += len) {
+        if ((len = strtol(rec, &key, 10)) <= 0 || rec + len > data + size ||
+            *key != ' ' || rec[len - 1] != '\n') {
+            fprintf(stderr, "invalid pax header\n");
+            exit(EINVAL);
         }
-        if (len + dir->rec_len == EXT2_BLOCK_SIZE) {
-            min_rec_len =
-                sizeof(struct ext2_dir_entry) + padding_name_len(dir->name_len);
-            extra_len = dir->rec_len - min_rec_len;
-            if (extra_len >= dir_entry_len) {
-                dir->rec_len = min_rec_len;
-                dir = offset_ptr(dir, dir->rec_len);
-                init_dent(dir, n_inode, extra_len, name_len, type, name);
-                ret = 0;
-            }
-            break;
+        rec[len - 1] = '\0';
+        if (!(value = strchr(++key, '='))) {
+            continue;
+        }
+        *value++ = '\0';
+        if (!strcmp(key, "path")) {
+            free(*name);
+            *name = strdup(value);
+        } else if (!strcmp(key, "linkpath")) {
+            free(*link);
+            *link = strdup(value);
         }
     }
+    free(data);
+}
 
-    return ret;
+void skip_tar_data(struct stream *st, long size) {
+    char buf[TAR_BLOCK];
+
+    for (long n; size > 0; size -= n) {
+        n = MIN(size, TAR_BLOCK);
+        stream_get(st, buf, n);
+    }
+}
+
+/* Whether tar_hdr's checksum, taken with the field as spaces, is right. */
+int check_tar_header() {
+    const unsigned char *p = (const unsigned char *)&tar_hdr;
+    long sum = 0;
+
+    for (int i = 0; i < TAR_BLOCK; ++i) {
+        if (i >= offsetof(struct tar_header, chksum) &&
+            i < offsetof(struct tar_header, typeflag)) {
+            sum += ' ';
+        } else {
+            sum += p[i];
+        }
+    }
+    return sum == parse_tar_number(tar_hdr.chksum, sizeof(tar_hdr.chksum))
+               ? 0
+               : -1;
+}
+
+/* Octal, or base-256 when the high bit of the first byte is set (GNU). */
+long parse_tar_number(const char *field, int len) {
+    long n = 0;
+    int i = 0;
+
+    if (field[0] & 0x80) {
+        n = field[0] & 0x3f;
+        for (i = 1; i < len; ++i) {
+            n = (n << 8) | (unsigned char)field[i];
+        }
+        return n;
+    }
+    for (; i < len && field[i] == ' '; ++i) {
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        n = n * 8 + field[i] - '0';
+    }
+    return n;
 }
 
-void del_dent(int n_inode, int n_pdir_inode) {
+/* New regular file dst, its size bytes of data read from st. */
+int import_tar_reg(struct stream *st, const char *dst, long size) {
+    int n_inode, n_pdir_inode;
     struct ext2_inode *inode;
+    struct path_tokens *pt;
+    unsigned char *block;
     int n_block;
-    int deleted;
+
+    if (size > 0 && (size - 1) / EXT2_BLOCK_SIZE >=
+                        12 + EXT2_BLOCK_SIZE / sizeof(unsigned int)) {
+        fprintf(stderr, "%s: file too large\n", dst);
+        exit(EFBIG);
+    }
+    n_pdir_inode = find_new_parent(dst, &pt);
+    n_inode = alloc_inode_reg();
+    add_dent_reg(n_inode, n_pdir_inode, get_path_tokens_last(pt));
+
+    TRACE_BEGIN(TRACE_COPY);
+    for (long off = 0; off < size; off += EXT2_BLOCK_SIZE) {
+        n_block = alloc_block_any(n_inode);
+        block = locate_new_block(n_block);
+        stream_get(st, block, MIN(size - off, EXT2_BLOCK_SIZE));
+        STAT_ADD(bytes_copied, MIN(size - off, EXT2_BLOCK_SIZE));
+        mark_block_dirty(n_block);
+        put_block(n_block);
+    }
+    TRACE_END(TRACE_COPY);
 
     inode = locate_inode(n_inode);
-    deleted = 0;
+    inode->i_size = size;
+    inode->i_dtime = 0;
+    mark_inode_dirty(n_inode);
 
-    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
-        if (!del_dent_in_block(n_inode, n_pdir_inode, n_block)) {
-            deleted = 1;
-            break;
+    destroy_path_tokens(pt);
+    return n_inode;
+}
+
+/* Permission bits, owner and mtime of tar_hdr onto n_inode. */
+void set_tar_meta(int n_inode) {
+    struct ext2_inode *inode;
+
+    inode = locate_inode(n_inode);
+    inode->i_mode = (inode->i_mode & ~07777) |
+                    (parse_tar_number(tar_hdr.mode, 8) & 07777);
+    inode->i_uid = parse_tar_number(tar_hdr.uid, 8);
+    inode->i_gid = parse_tar_number(tar_hdr.gid, 8);
+    inode->i_mtime = parse_tar_number(tar_hdr.mtime, 12);
+    mark_inode_dirty(n_inode);
+}
+
+/* Add n_inode as name, then everything below it, in preorder. */
+void collect_tar(int n_inode, const char *name) {
+    struct tar_entry *e;
+    char *path, **names;
+    int *children;
+    int num;
+
+    if (tar_num == tar_max) {
+        tar_max = tar_max ? tar_max * 2 : 256;
+        if (!(tar_entries = realloc(tar_entries,
+                                    tar_max * sizeof(struct tar_entry)))) {
+            perror("realloc");
+            exit(ENOMEM);
         }
     }
+    e = &tar_entries[tar_num];
+    if (!(e->name = strdup(name))) {
+        perror("strdup");
+        exit(ENOMEM);
+    }
+    e->n_inode = n_inode;
+    e->is_dir = is_inode_dir(n_inode);
+    e->n_first_block = is_inode_reg(n_inode) ? find_block_linear(n_inode, 0)
+                                             : 0;
+    e->order = tar_num++;
+    if (!e->is_dir) {
+        return;
+    }
 
-    if (deleted) {
-        --inode->i_links_count;
+    num = list_dents(n_inode, &children, &names);
+    release_blocks();
+    for (int i = 0; i < num; ++i) {
+        if (asprintf(&path, "%s%s%s", name, name[0] ? "/" : "", names[i]) <
+            0) {
+            perror("asprintf");
+            exit(ENOMEM);
+        }
+        collect_tar(children[i], path);
+        free(path);
+        free(names[i]);
     }
+    free(children);
+    free(names);
 }
 
-int del_dent_in_block(int n_inode, int n_pdir_inode, int n_block) {
-    struct ext2_dir_entry *dir, *prev_dir;
-    int ret;
+/* Directories in walk order, then by first block; empty files lead. */
+int cmp_tar_entry(const void *a, const void *b) {
+    const struct tar_entry *ea = a, *eb = b;
 
-    prev_dir = NULL;
-    dir = locate_block(n_block);
-    ret = -1;
+    if (ea->is_dir != eb->is_dir) {
+        return eb->is_dir - ea->is_dir;
+    }
+    if (!ea->is_dir && ea->n_first_block != eb->n_first_block) {
+        return ea->n_first_block < eb->n_first_block ? -1 : 1;
+    }
+    return ea->order - eb->order;
+}
 
-    for (int len = 0; len < EXT2_BLOCK_SIZE; len += dir->rec_len,
-             prev_dir = dir, dir = offset_ptr(dir, dir->rec_len)) {
-        if (dir->inode == n_inode) {
-            prev_dir->rec_len += dir->rec_len;
-            ret = 0;
-            break;
+/* Header and data of tar_entries[i]; returns the bytes written. */
+long put_tar_entry(struct stream *st, int i, const char *link, int type) {
+    static const char zero[TAR_BLOCK];
+    const struct tar_entry *e = &tar_entries[i];
+    char *name;
+    long size, total;
+    int n_block;
+
+    if (asprintf(&name, "%s%s", e->name, type == '5' ? "/" : "") < 0) {
+        perror("asprintf");
+        exit(ENOMEM);
+    }
+    size = type == '0' ? locate_inode(e->n_inode)->i_size : 0;
+    total = put_tar_header(st, name, e->n_inode, size, type, link);
+    free(name);
+
+    TRACE_BEGIN(TRACE_COPY);
+    for (long off = 0; off < size; off += EXT2_BLOCK_SIZE) {
+        if ((n_block = find_block_linear(e->n_inode, off / EXT2_BLOCK_SIZE))) {
+            stream_put(st, locate_block(n_block),
+                       MIN(size - off, EXT2_BLOCK_SIZE));
+            put_block(n_block);
+        } else {
+            for (long n = 0; n < MIN(size - off, EXT2_BLOCK_SIZE);
+                 n += TAR_BLOCK) {
+                stream_put(st, zero, MIN(size - off - n, TAR_BLOCK));
+            }
         }
+        STAT_ADD(bytes_copied, MIN(size - off, EXT2_BLOCK_SIZE));
     }
+    TRACE_END(TRACE_COPY);
+    stream_put(st, zero, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
 
-    return ret;
+    return total + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
 }
 
-int iterate_dent(int n_pdir_inode, cb_iterate_dent cb) {
-    int cnt;
-    struct ext2_inode *pdir_inode;
-    struct ext2_dir_entry *dir;
-    int n_block;
-
-    pdir_inode = locate_inode(n_pdir_inode);
-    cnt = 0;
+/*
+ * ustar header for name, split into prefix and name when that fits and
+ * preceded by GNU long name entries when not. n_inode 0 means no owner
+ * or times. Returns the bytes written.
+ */
+long put_tar_header(struct stream *st, const char *name, int n_inode,
+                    long size, int type, const char *link) {
+    static const char zero[TAR_BLOCK];
+    struct tar_header hdr;
+    struct ext2_inode *inode;
+    const char *base;
+    unsigned int sum;
+    long total;
+    int len;
+
+    total = 0;
+    if (strlen(link) > sizeof(hdr.linkname)) {
+        total += put_tar_header(st, "././@LongLink", 0, strlen(link) + 1, 'K',
+                                "");
+        stream_put(st, link, strlen(link) + 1);
+        stream_put(st, zero, (TAR_BLOCK - (strlen(link) + 1) % TAR_BLOCK) %
+                                 TAR_BLOCK);
+        total += (strlen(link) + TAR_BLOCK) / TAR_BLOCK * TAR_BLOCK;
+    }
 
-    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
-        dir = locate_block(pdir_inode->i_block[i]);
-        for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
-             len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
-            cnt += cb(dir);
-            if (dir->name_len == 1 && !strncmp(dir->name, ".", 1)) {
-                continue;
-            }
-            if (dir->name_len == 2 && !strncmp(dir->name, "..", 2)) {
-                continue;
-            }
-            if (is_dent_dir(dir)) {
-                cnt += iterate_dent(dir->inode, cb);
-            }
+    memset(&hdr, 0, sizeof(hdr));
+    len = strlen(name);
+    base = name;
+    if (len > sizeof(hdr.name)) {
+        /* the first slash leaving a short enough name, in a short prefix */
+        for (base = strchr(name, '/'); base && len - (base - name) - 1 >
+                                                   sizeof(hdr.name);
+             base = strchr(base + 1, '/')) {
         }
+        if (base && base > name && base - name <= sizeof(hdr.prefix) &&
+            base[1]) {
+            memcpy(hdr.prefix, name, base - name);
+            ++base;
+        } else {
+            total += put_tar_header(st, "././@LongLink", 0, len + 1, 'L', "");
+            stream_put(st, name, len + 1);
+            stream_put(st, zero, (TAR_BLOCK - (len + 1) % TAR_BLOCK) %
+                                     TAR_BLOCK);
+            total += (len + TAR_BLOCK) / TAR_BLOCK * TAR_BLOCK;
+            base = name;
+        }
+    }
+    strncpy(hdr.name, base, sizeof(hdr.name));
+    strncpy(hdr.linkname, link, sizeof(hdr.linkname));
+
+    inode = n_inode ? locate_inode(n_inode) : NULL;
+    snprintf(hdr.mode, sizeof(hdr.mode), "%07o",
+             inode ? get_inode_perms(n_inode) : 0644);
+    snprintf(hdr.uid, sizeof(hdr.uid), "%07o", inode ? inode->i_uid : 0);
+    snprintf(hdr.gid, sizeof(hdr.gid), "%07o", inode ? inode->i_gid : 0);
+    snprintf(hdr.size, sizeof(hdr.size), "%011lo", size);
+    snprintf(hdr.mtime, sizeof(hdr.mtime), "%011o",
+             inode ? inode->i_mtime : 0);
+    hdr.typeflag = type;
+    memcpy(hdr.magic, "ustar", 6);
+    memcpy(hdr.version, "00", 2);
+
+    memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+    sum = 0;
+    for (int i = 0; i < TAR_BLOCK; ++i) {
+        sum += ((unsigned char *)&hdr)[i];
     }
+    snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", sum);
 
-    return cnt;
+    stream_put(st, &hdr, TAR_BLOCK);
+    return total + TAR_BLOCK;
 }
 
-int find_dent_by_name(int n_pdir_inode, const char *name,
-                      struct ext2_dir_entry **dent) {
-    int name_len;
-    struct ext2_inode *pdir_inode;
-    struct ext2_dir_entry *dir;
-    int n_block;
+/* ------------------- defragment ------------------- */
 
-    name_len = strlen(name);
-    pdir_inode = locate_inode(n_pdir_inode);
+int cb_collect_defrag(struct ext2_dir_entry *dent) {
+    if (dent->inode < 1 || dent->inode > sb->s_inodes_count ||
+        (dent->name_len == 1 && !strncmp(dent->name, ".", 1)) ||
+        (dent->name_len == 2 && !strncmp(dent->name, "..", 2))) {
+        return 0;
+    }
+    if (!chk_bit(dent->inode - 1, defrag_seen)) {
+        set_bit(dent->inode - 1, defrag_seen);
+        defrag_inodes[defrag_num++] = dent->inode;
+    }
+    return 0;
+}
 
-    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
-        dir = locate_block(pdir_inode->i_block[i]);
-        for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
-             len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
-            if (dir->inode != 0 && dir->name_len == name_len &&
-                !strncmp(name, dir->name, name_len)) {
-                *dent = dir;
-                return dir->inode;
-            }
+/*
+ * Number of physically contiguous runs among the mapped blocks; holes do
+ * not break a run. The inode's own indirect block sitting in front of the
+ * first block mapped through it does not either, since that is where
+ * defrag_inode() puts it.
+ */
+int count_fragments(int n_inode) {
+    struct ext2_inode *inode;
+    int n_block, n_prev_block;
+    int cnt, is_ind;
+
+    inode = locate_inode(n_inode);
+    n_prev_block = 0;
+    cnt = is_ind = 0;
+
+    for (int i = 0; (n_block = find_block_next(n_inode, &i)); ++i) {
+        if (i >= 12 && !is_ind++ && n_prev_block + 1 == inode->i_block[12]) {
+            ++n_prev_block;
+        }
+        if (n_block != n_prev_block + 1) {
+            ++cnt;
+        }
+        n_prev_block = n_block;
+    }
+
+    return cnt;
+}
+
+int find_free_run(int num) {
+    int len = 0;
+    for (int n_block = 1; n_block <= sb->s_blocks_count; ++n_block) {
+        len = chk_blockbit(n_block) ? 0 : len + 1;
+        if (len == num) {
+            return n_block - num + 1;
         }
     }
-
     return -1;
 }
 
-int find_dent_dir_by_path(const struct path_tokens *pt) {
-    int type;
-    int n_inode;
-    n_inode = find_dent_by_path(pt, &type);
-    return n_inode < 0 ? -1 : (type == EXT2_FT_DIR ? n_inode : -1);
-}
+/*
+ * Move the mapped blocks of n_inode into one free run laid out as
+ * [0..11][indirect][12..], keeping every block at its index so holes stay
+ * holes. New blocks are marked and filled before the inode is switched
+ * over, and old blocks are freed only afterwards, so an interrupted run
+ * leaks blocks at worst and never leaves a reference to a free block.
+ */
+int defrag_inode(int n_inode) {
+    struct ext2_inode *inode;
+    unsigned int new_i_block[15];
+    unsigned int *old_blocks, *ind_block;
+    int n_blocks, n_run, n_start, n_fragments;
+    int n_block, n_new_block, k;
 
-int find_dent_any_by_path(const struct path_tokens *pt) {
-    int type;
-    return find_dent_by_path(pt, &type);
-}
+    inode = locate_inode(n_inode);
 
-int find_dent_by_path(const struct path_tokens *pt, int *type) {
-    struct ext2_dir_entry *dir;
-    int n_dir_inode;
+    /* the double indirect journal layout is not ours to move */
+    if (!chk_inodebit(n_inode) || is_inode_fastsym(n_inode) ||
+        inode->i_block[13] || (n_fragments = count_fragments(n_inode)) <= 1) {
+        return 0;
+    }
 
-    n_dir_inode = 2;
-    *type = EXT2_FT_DIR;
+    n_blocks = count_blocks(n_inode);
+    n_run = n_blocks + (inode->i_block[12] ? 1 : 0);
+    if ((n_start = find_free_run(n_run)) < 0) {
+        fprintf(stderr, "no free run of %d blocks for inode [%d]\n", n_run,
+                n_inode);
+        return 0;
+    }
 
-    for (int i = 0; i < pt->num; ++i) {
-        if ((n_dir_inode =
-                 find_dent_by_name(n_dir_inode, pt->tokens[i], &dir)) < 0) {
-            break;
+    if (!(old_blocks = malloc(sizeof(unsigned int) * n_blocks))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    memset(new_i_block, 0, sizeof(new_i_block));
+    ind_block = NULL;
+    n_new_block = n_start;
+    k = 0;
+    prefetch_inode_blocks(n_inode, BLOCK_DATA);
+    for (int i = 0; (n_block = find_block_next(n_inode, &i)); ++i) {
+        if (i >= 12 && !ind_block) {
+            restore_block(n_new_block);
+            init_block(n_new_block);
+            new_i_block[12] = n_new_block;
+            ind_block = locate_meta_block(n_new_block++);
         }
-        *type = get_dent_type(dir);
+        old_blocks[k++] = n_block;
+        restore_block(n_new_block);
+        memcpy(locate_new_block(n_new_block), locate_block(n_block),
+               EXT2_BLOCK_SIZE);
+        STAT_ADD(bytes_copied, EXT2_BLOCK_SIZE);
+        mark_block_dirty(n_new_block);
+        put_block(n_new_block);
+        put_block(n_block);
+        if (i < 12) {
+            new_i_block[i] = n_new_block;
+        } else {
+            ind_block[i - 12] = n_new_block;
+        }
+        ++n_new_block;
     }
 
-    return n_dir_inode;
+    if (new_i_block[12]) {
+        mark_block_dirty(new_i_block[12]);
+    }
+
+    n_block = inode->i_block[12];
+    memcpy(inode->i_block, new_i_block, sizeof(new_i_block));
+    mark_inode_dirty(n_inode);
+
+    for (int i = 0; i < n_blocks; ++i) {
+        free_block(old_blocks[i]);
+    }
+    if (n_block) {
+        free_block(n_block);
+    }
+    free(old_blocks);
+
+    if (is_inode_dir(n_inode)) {
+        drop_dir_gaps(n_inode);
+    }
+
+    printf("Defragmented: inode [%d] from %d fragments to 1\n", n_inode,
+           n_fragments);
+
+    return 1;
 }
 
-struct ext2_dir_entry *find_deleteddent_helper(int n_pdir_inode,
-                                               const char *name,
-                                               struct ext2_dir_entry **prev_dir,
-                                               int *rec_len) {
-    int name_len;
-    int dir_entry_len;
-    struct ext2_inode *pdir_inode;
-    struct ext2_dir_entry *dir, *try_dir;
-    int min_rec_len, extra_len;
-    int n_block;
+/* ------------------- discard ------------------- */
 
-    name_len = strlen(name);
-    dir_entry_len = sizeof(struct ext2_dir_entry) + get_name_len(name);
-    pdir_inode = locate_inode(n_pdir_inode);
+void queue_discard(int n_block) {
+    if (!discard_bmp &&
+        !(discard_bmp = calloc(sb->s_blocks_count / 8 + 1, 1))) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+    set_bit(n_block - 1, discard_bmp);
+}
 
-    for (int i = 0; (n_block = find_block_linear(n_pdir_inode, i)); ++i) {
-        dir = locate_block(pdir_inode->i_block[i]);
-        for (int len = 0; len < EXT2_BLOCK_SIZE && dir->rec_len != 0;
-             len += dir->rec_len, dir = offset_ptr(dir, dir->rec_len)) {
-            *prev_dir = try_dir = dir;
-            for (int _len = 0; _len < dir->rec_len && try_dir->rec_len != 0 &&
-                               try_dir->name_len != 0;) {
-                min_rec_len = sizeof(struct ext2_dir_entry) +
-                              padding_name_len(try_dir->name_len);
-                try_dir = offset_ptr(try_dir, min_rec_len);
-                _len += min_rec_len;
-                extra_len = dir->rec_len - _len;
-                if (extra_len < dir_entry_len) {
-                    break;
-                }
-                if (try_dir->inode != 0 && try_dir->rec_len >= dir_entry_len &&
-                    try_dir->name_len == name_len &&
-                    !strncmp(try_dir->name, name, name_len)) {
-                    *rec_len = extra_len;
-                    return try_dir;
-                }
+/*
+ * Punch out runs of blocks that are free in the block bitmap and, unless
+ * all_free is set, were queued by free_block(). A block reallocated after
+ * being freed is skipped. Adjacent blocks share one fallocate() call.
+ * Returns the number of runs punched, or -1 if the host FS refused;
+ * *n_punched, if given, gets the number of blocks in them.
+ */
+int flush_discard(int all_free, int *n_punched) {
+    int n_start, n_runs, n_blocks;
+
+    n_start = 0;
+    n_runs = 0;
+    n_blocks = 0;
+
+    for (int n_block = 1; n_block <= sb->s_blocks_count + 1; ++n_block) {
+        if (n_block <= sb->s_blocks_count && !chk_blockbit(n_block) &&
+            (all_free || chk_bit(n_block - 1, discard_bmp))) {
+            if (!n_start) {
+                n_start = n_block;
             }
+        } else if (n_start) {
+            if (discard_blocks(n_start, n_block - n_start) < 0) {
+                return -1;
+            }
+            ++n_runs;
+            n_blocks += n_block - n_start;
+            n_start = 0;
         }
     }
 
-    return NULL;
+    if (n_punched) {
+        *n_punched = n_blocks;
+    }
+    return n_runs;
 }
 
-int find_deleteddent(int n_pdir_inode, const char *name, int *type) {
-    int rec_len;
-    struct ext2_dir_entry *dir, *prev_dir;
+/* ------------------- block groups ------------------- */
 
-    if (!(dir = find_deleteddent_helper(n_pdir_inode, name, &prev_dir,
-                                        &rec_len))) {
-        return -1;
+int count_groups() {
+    return (sb->s_blocks_count - sb->s_first_data_block +
+            sb->s_blocks_per_group - 1) /
+           sb->s_blocks_per_group;
+}
+
+/* The last group may be short. */
+int count_group_blocks(int n_group) {
+    return MIN(sb->s_blocks_per_group,
+               sb->s_blocks_count - sb->s_first_data_block -
+                   n_group * sb->s_blocks_per_group);
+}
+
+/* With sparse_super, backups only live in groups 0, 1 and powers of 3/5/7. */
+int group_has_super(int n_group) {
+    if (n_group <= 1 ||
+        !(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return 1;
+    }
+    for (int base = 3; base <= 7; base += 2) {
+        int n = base;
+        while (n < n_group) {
+            n *= base;
+        }
+        if (n == n_group) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    *type = get_dent_type(dir);
+int count_gdt_blocks() {
+    return (count_groups() + EXT2_DESC_PER_BLOCK - 1) / EXT2_DESC_PER_BLOCK;
+}
 
-    return dir->inode;
+int find_block_group(int n_block) {
+    return (n_block - sb->s_first_data_block) / sb->s_blocks_per_group;
 }
 
-void restore_deleteddent(int n_pdir_inode, const char *name) {
-    int rec_len;
-    struct ext2_dir_entry *dir, *prev_dir;
-    struct ext2_inode *inode;
+int find_inode_group(int n_inode) {
+    return (n_inode - 1) / sb->s_inodes_per_group;
+}
 
-    if (!(dir = find_deleteddent_helper(n_pdir_inode, name, &prev_dir,
-                                        &rec_len))) {
-        return;
-    }
+struct ext2_group_desc *locate_group(int n_group) {
+    struct ext2_group_desc *block;
+    block = locate_meta_block(sb->s_first_data_block + 1 +
+                              n_group / EXT2_DESC_PER_BLOCK);
+    return block + n_group % EXT2_DESC_PER_BLOCK;
+}
 
-    prev_dir->rec_len = calc_offset_ptr(dir, prev_dir);
-    dir->rec_len = rec_len;
+struct ext2_group_desc *locate_block_group(int n_block) {
+    return locate_group(find_block_group(n_block));
+}
 
-    inode = locate_inode(dir->inode);
-    ++inode->i_links_count;
+struct ext2_group_desc *locate_inode_group(int n_inode) {
+    return locate_group(find_inode_group(n_inode));
+}
+
+void mark_group_dirty(int n_group) {
+    mark_block_dirty(1);
+    mark_block_dirty(sb->s_first_data_block + 1 +
+                     n_group / EXT2_DESC_PER_BLOCK);
 }
 
 /* ------------------- manipulate disk pointer ------------------- */
@@ -911,11 +4189,57 @@ int calc_offset_ptr(void *ptr1, void *ptr2) {
     return (char *)ptr1 - (char *)ptr2;
 }
 
+int find_inode_block(int n_inode) {
+    return locate_inode_group(n_inode)->bg_inode_table +
+           (n_inode - 1) % sb->s_inodes_per_group * sizeof(struct ext2_inode) /
+               EXT2_BLOCK_SIZE;
+}
+
 struct ext2_inode *locate_inode(int n_inode) {
-    return inode_tbl + (n_inode - 1);
+    struct ext2_inode *block;
+    block = locate_meta_block(find_inode_block(n_inode));
+    return block +
+           (n_inode - 1) % (EXT2_BLOCK_SIZE / sizeof(struct ext2_inode));
 }
 
-void *locate_block(int n_block) { return disk + EXT2_BLOCK_SIZE * n_block; }
+void *locate_block(int n_block) { return get_block(n_block, BLOCK_DATA); }
+void *locate_meta_block(int n_block) { return get_block(n_block, BLOCK_META); }
+void *locate_new_block(int n_block) {
+    return get_new_block(n_block, BLOCK_DATA);
+}
+
+/* Queue every block of an inode, direct and behind i_block[12], at once. */
+void prefetch_inode_blocks(int n_inode, int type) {
+    struct ext2_inode *inode;
+    int blocks[12 + EXT2_BLOCK_SIZE / 4];
+    unsigned int *ind_block;
+    int num;
+
+    inode = locate_inode(n_inode);
+    if (is_inode_fastsym(n_inode)) {
+        return;
+    }
+
+    for (num = 0; num < 12; ++num) {
+        blocks[num] = inode->i_block[num];
+    }
+    if (inode->i_block[12]) {
+        ind_block = locate_meta_block(inode->i_block[12]);
+        for (int i = 0; i < EXT2_BLOCK_SIZE / 4; ++i) {
+            blocks[num++] = ind_block[i];
+        }
+    }
+
+    prefetch_blocks(blocks, num, type);
+}
+
+void mark_inode_dirty(int n_inode) {
+    mark_block_dirty(find_inode_block(n_inode));
+}
+void mark_counts_dirty() {
+    mark_block_dirty(1);
+    mark_block_dirty(2);
+}
 
 /* ------------------- dir_entry name length ------------------- */
 
@@ -939,29 +4263,117 @@ void clr_bit(int bit, unsigned char *bitmap) {
     int i = bit / 8, j = bit % 8;
     bitmap[i] &= ~(1UL << j);
 }
+/* Set bits [from, to), whole bytes at a time where possible. */
+void set_bits(int from, int to, unsigned char *bitmap) {
+    for (; from < to && from % 8; ++from) {
+        set_bit(from, bitmap);
+    }
+    if (to - from >= 8) {
+        memset(bitmap + from / 8, 0xFF, (to - from) / 8);
+        from += (to - from) / 8 * 8;
+    }
+    for (; from < to; ++from) {
+        set_bit(from, bitmap);
+    }
+}
+int count_free_bits(const unsigned char *bitmap, int num) {
+    int cnt = 0;
+    for (int bit = 0; bit < num; ++bit) {
+        cnt += !chk_bit(bit, bitmap);
+    }
+    return cnt;
+}
 
-int chk_inodebit(int n_inode) { return chk_bit(n_inode - 1, inode_bmp); }
-int chk_blockbit(int n_block) { return chk_bit(n_block - 1, block_bmp); }
-void set_inodebit(int n_inode) { set_bit(n_inode - 1, inode_bmp); }
-void set_blockbit(int n_block) { set_bit(n_block - 1, block_bmp); }
-void clr_inodebit(int n_inode) { clr_bit(n_inode - 1, inode_bmp); }
-void clr_blockbit(int n_block) { clr_bit(n_block - 1, block_bmp); }
+/* Numbers outside the image count as in use, so nothing allocates them. */
+int chk_inodebit(int n_inode) {
+    struct ext2_group_desc *bg;
+    if (n_inode < 1 || n_inode > sb->s_inodes_count) {
+        return 1;
+    }
+    bg = locate_inode_group(n_inode);
+    return chk_bit(INODE_BIT(sb, n_inode),
+                   locate_meta_block(bg->bg_inode_bitmap));
+}
+int chk_blockbit(int n_block) {
+    struct ext2_group_desc *bg;
+    if (n_block < sb->s_first_data_block || n_block >= sb->s_blocks_count) {
+        return 1;
+    }
+    bg = locate_block_group(n_block);
+    return chk_bit(BLOCK_BIT(sb, n_block),
+                   locate_meta_block(bg->bg_block_bitmap));
+}
+void set_inodebit(int n_inode) {
+    struct ext2_group_desc *bg = locate_inode_group(n_inode);
+    set_bit(INODE_BIT(sb, n_inode), locate_meta_block(bg->bg_inode_bitmap));
+    mark_block_dirty(bg->bg_inode_bitmap);
+    mark_group_dirty(find_inode_group(n_inode));
+}
+void set_blockbit(int n_block) {
+    struct ext2_group_desc *bg = locate_block_group(n_block);
+    set_bit(BLOCK_BIT(sb, n_block), locate_meta_block(bg->bg_block_bitmap));
+    mark_block_dirty(bg->bg_block_bitmap);
+    mark_group_dirty(find_block_group(n_block));
+}
+void clr_inodebit(int n_inode) {
+    free_inode_hint = MIN(free_inode_hint, n_inode);
+    struct ext2_group_desc *bg = locate_inode_group(n_inode);
+    clr_bit(INODE_BIT(sb, n_inode), locate_meta_block(bg->bg_inode_bitmap));
+    mark_block_dirty(bg->bg_inode_bitmap);
+    mark_group_dirty(find_inode_group(n_inode));
+}
+void clr_blockbit(int n_block) {
+    free_block_hint = MIN(free_block_hint, n_block);
+    struct ext2_group_desc *bg = locate_block_group(n_block);
+    clr_bit(BLOCK_BIT(sb, n_block), locate_meta_block(bg->bg_block_bitmap));
+    mark_block_dirty(bg->bg_block_bitmap);
+    mark_group_dirty(find_block_group(n_block));
+}
 
 /* ------------------- find free block/inode ------------------- */
 
+/*
+ * Scan each group's bitmap a byte at a time, skipping full bytes, from
+ * the hint on: the lowest free block is still the one returned.
+ */
 int find_free_block() {
-    for (int n_block = 1; n_block <= sb->s_blocks_count; ++n_block) {
-        if (!chk_blockbit(n_block)) {
-            return n_block;
+    unsigned char *bitmap;
+    int num, start, bit;
+
+    start = MAX(free_block_hint, sb->s_first_data_block);
+    for (int g = find_block_group(start); g < count_groups(); ++g) {
+        bitmap = locate_meta_block(locate_group(g)->bg_block_bitmap);
+        num = count_group_blocks(g);
+        bit = g == find_block_group(start) ? BLOCK_BIT(sb, start) : 0;
+        for (; bit < num; ++bit) {
+            STAT_INC(bits_scanned);
+            if (bit % 8 == 0 && bitmap[bit / 8] == 0xFF) {
+                STAT_ADD(bits_scanned, 7);
+                bit += 7;
+            } else if (!chk_bit(bit, bitmap)) {
+                return free_block_hint = sb->s_first_data_block +
+                                         g * sb->s_blocks_per_group + bit;
+            }
         }
     }
     return -1;
 }
 int find_free_inode() {
-    for (int n_inode = EXT2_GOOD_OLD_FIRST_INO; n_inode <= sb->s_inodes_count;
-         ++n_inode) {
-        if (!chk_inodebit(n_inode)) {
-            return n_inode;
+    unsigned char *bitmap;
+    int start, bit;
+
+    start = MAX(free_inode_hint, EXT2_GOOD_OLD_FIRST_INO);
+    for (int g = find_inode_group(start); g < count_groups(); ++g) {
+        bitmap = locate_meta_block(locate_group(g)->bg_inode_bitmap);
+        bit = g == find_inode_group(start) ? INODE_BIT(sb, start) : 0;
+        for (; bit < sb->s_inodes_per_group; ++bit) {
+            STAT_INC(bits_scanned);
+            if (bit % 8 == 0 && bitmap[bit / 8] == 0xFF) {
+                STAT_ADD(bits_scanned, 7);
+                bit += 7;
+            } else if (!chk_bit(bit, bitmap)) {
+                return free_inode_hint = g * sb->s_inodes_per_group + bit + 1;
+            }
         }
     }
     return -1;
@@ -969,56 +4381,65 @@ int find_free_inode() {
 
 int alloc_block() {
     int n_block;
+    TRACE_BEGIN(TRACE_ALLOC);
     if (sb->s_free_blocks_count == 0 || (n_block = find_free_block()) < 0) {
         fprintf(stderr, "no free block found\n");
         exit(ENOSPC);
     }
     set_blockbit(n_block);
     --sb->s_free_blocks_count;
-    --gd->bg_free_blocks_count;
+    --locate_block_group(n_block)->bg_free_blocks_count;
     init_block(n_block);
+    TRACE_END(TRACE_ALLOC);
     return n_block;
 }
 int alloc_inode() {
     int n_inode;
+    TRACE_BEGIN(TRACE_ALLOC);
     if (sb->s_free_inodes_count == 0 || (n_inode = find_free_inode()) < 0) {
         fprintf(stderr, "no free inode found\n");
         exit(ENOSPC);
     }
     set_inodebit(n_inode);
     --sb->s_free_inodes_count;
-    --gd->bg_free_inodes_count;
+    --locate_inode_group(n_inode)->bg_free_inodes_count;
     init_inode(n_inode);
+    TRACE_END(TRACE_ALLOC);
     return n_inode;
 }
 
 void restore_block(int n_block) {
     set_blockbit(n_block);
     --sb->s_free_blocks_count;
-    --gd->bg_free_blocks_count;
+    --locate_block_group(n_block)->bg_free_blocks_count;
 }
 void restore_inode(int n_inode) {
     set_inodebit(n_inode);
     --sb->s_free_inodes_count;
-    --gd->bg_free_inodes_count;
+    --locate_inode_group(n_inode)->bg_free_inodes_count;
 }
 
 void free_block(int n_block) {
     clr_blockbit(n_block);
     ++sb->s_free_blocks_count;
-    ++gd->bg_free_blocks_count;
+    ++locate_block_group(n_block)->bg_free_blocks_count;
+    if (discard) {
+        queue_discard(n_block);
+    }
 }
 void free_inode(int n_inode) {
     clr_inodebit(n_inode);
     ++sb->s_free_inodes_count;
-    ++gd->bg_free_inodes_count;
+    ++locate_inode_group(n_inode)->bg_free_inodes_count;
 }
 
 void init_block(int n_block) {
-    memset(locate_block(n_block), 0, EXT2_BLOCK_SIZE);
+    memset(locate_new_block(n_block), 0, EXT2_BLOCK_SIZE);
+    mark_block_dirty(n_block);
 }
 void init_inode(int n_inode) {
     memset(locate_inode(n_inode), 0, sizeof(struct ext2_inode));
+    mark_inode_dirty(n_inode);
 }
 
 int alloc_block_any(int n_inode) {
@@ -1029,6 +4450,7 @@ int alloc_block_any(int n_inode) {
 
     inode = locate_inode(n_inode);
 
+    n_block = -1;
     is_allocated = 0;
 
     for (int i = 0; i < 12; ++i) {
@@ -1043,17 +4465,53 @@ int alloc_block_any(int n_inode) {
         if (!inode->i_block[12]) {
             inode->i_block[12] = alloc_block();
         }
-        block = locate_block(inode->i_block[12]);
+        block = locate_meta_block(inode->i_block[12]);
         for (int i = 0; i < EXT2_BLOCK_SIZE / 4; ++i) {
             if (!block[i]) {
                 block[i] = n_block = alloc_block();
                 break;
             }
         }
+        mark_block_dirty(inode->i_block[12]);
+    }
+
+    if (n_block < 0) {
+        fprintf(stderr, "file too large\n");
+        exit(EFBIG);
     }
 
     inode->i_size += EXT2_BLOCK_SIZE;
     inode->i_blocks += EXT2_BLOCK_SIZE / 512;
+    mark_inode_dirty(n_inode);
+
+    return n_block;
+}
+
+/* Block for index i of n_inode, which has none there, e.g. a hole. */
+int alloc_block_at(int n_inode, int i) {
+    int n_block;
+    struct ext2_inode *inode;
+    unsigned int *block;
+
+    if (i >= 12 + EXT2_BLOCK_SIZE / 4) {
+        fprintf(stderr, "file too large\n");
+        exit(EFBIG);
+    }
+
+    inode = locate_inode(n_inode);
+    n_block = alloc_block();
+    if (i < 12) {
+        inode->i_block[i] = n_block;
+    } else {
+        if (!inode->i_block[12]) {
+            inode->i_block[12] = alloc_block();
+        }
+        block = locate_meta_block(inode->i_block[12]);
+        block[i - 12] = n_block;
+        mark_block_dirty(inode->i_block[12]);
+    }
+    inode->i_blocks += EXT2_BLOCK_SIZE / 512;
+    mark_inode_dirty(n_inode);
 
     return n_block;
 }
@@ -1067,6 +4525,7 @@ int alloc_inode_w_mode(int mode) {
     inode = locate_inode(n_inode);
     inode->i_mode = mode;
     inode->osd1 = 1;
+    mark_inode_dirty(n_inode);
 
     return n_inode;
 }
@@ -1075,6 +4534,345 @@ int alloc_inode_dir() { return alloc_inode_w_mode(EXT2_S_IFDIR); }
 int alloc_inode_reg() { return alloc_inode_w_mode(EXT2_S_IFREG); }
 int alloc_inode_sym() { return alloc_inode_w_mode(EXT2_S_IFLNK); }
 
+/* ------------------- make file system ------------------- */
+
+/* Fill in a superblock for n_blocks, dropping a last group too small to use. */
+void layout_image(struct ext2_super_block *new_sb, int n_blocks,
+                  int inode_ratio) {
+    int n_groups, n_inodes;
+
+    memset(new_sb, 0, sizeof(struct ext2_super_block));
+    sb = new_sb;
+    sb->s_first_data_block = 1;
+    sb->s_blocks_per_group = EXT2_BLOCK_SIZE * 8;
+    sb->s_frags_per_group = sb->s_blocks_per_group;
+    sb->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+    sb->s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+
+    for (;;) {
+        sb->s_blocks_count = n_blocks;
+        n_groups = count_groups();
+        n_inodes = ((long long)n_blocks * EXT2_BLOCK_SIZE / inode_ratio +
+                    n_groups - 1) /
+                   n_groups;
+        /* whole inode table blocks, and room for the reserved inodes */
+        n_inodes = (n_inodes + 7) / 8 * 8;
+        n_inodes = MAX(n_inodes, 16);
+        n_inodes = MIN(n_inodes, EXT2_BLOCK_SIZE * 8);
+        sb->s_inodes_per_group = n_inodes;
+        if (n_groups == 1 ||
+            count_group_blocks(n_groups - 1) >=
+                count_group_overhead(n_groups - 1) + MKFS_MIN_BLOCKS) {
+            break;
+        }
+        n_blocks = sb->s_first_data_block +
+                   (n_groups - 1) * sb->s_blocks_per_group;
+    }
+    if (n_blocks < count_group_overhead(0) + MKFS_MIN_BLOCKS) {
+        fprintf(stderr, "image of %d blocks is too small\n", n_blocks);
+        exit(EINVAL);
+    }
+
+    sb->s_inodes_count = sb->s_inodes_per_group * n_groups;
+    sb->s_r_blocks_count = n_blocks / 20;
+    sb->s_free_inodes_count =
+        sb->s_inodes_count - (EXT2_GOOD_OLD_FIRST_INO - 1);
+    sb->s_free_blocks_count = n_blocks - sb->s_first_data_block;
+    for (int g = 0; g < n_groups; ++g) {
+        sb->s_free_blocks_count -= count_group_overhead(g);
+    }
+    sb->s_log_block_size = 0;
+    sb->s_log_frag_size = 0;
+    sb->s_wtime = sb->s_lastcheck = time(NULL);
+    sb->s_max_mnt_count = 0xFFFF;
+    sb->s_magic = EXT2_SUPER_MAGIC;
+    sb->s_state = 1;   /* cleanly unmounted */
+    sb->s_errors = 1;  /* continue */
+    sb->s_rev_level = 1;
+    sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    sb->s_inode_size = sizeof(struct ext2_inode);
+    if (getentropy(sb->s_uuid, sizeof(sb->s_uuid)) != 0) {
+        perror("getentropy");
+        exit(EIO);
+    }
+    sb->s_uuid[6] = (sb->s_uuid[6] & 0x0F) | 0x40;
+    sb->s_uuid[8] = (sb->s_uuid[8] & 0x3F) | 0x80;
+    sb = NULL;
+}
+
+/* Superblock and descriptor copies, bitmaps and inode table of a group. */
+int count_group_overhead(int n_group) {
+    return (group_has_super(n_group) ? 1 + count_gdt_blocks() : 0) + 2 +
+           sb->s_inodes_per_group * sizeof(struct ext2_inode) / EXT2_BLOCK_SIZE;
+}
+
+/*
+ * Write the bitmaps of a group and, if it keeps one, its copy of the
+ * descriptor table. buf holds a block and the table; the descriptors are
+ * filled in when group 0 is written.
+ */
+void write_group_meta(int n_group, unsigned char *buf) {
+    struct ext2_group_desc *gdt = (struct ext2_group_desc *)(buf +
+                                                             EXT2_BLOCK_SIZE);
+    int n_first, n_meta, n_reserved;
+
+    if (n_group == 0) {
+        for (int g = 0; g < count_groups(); ++g) {
+            n_first = sb->s_first_data_block + g * sb->s_blocks_per_group;
+            n_meta = n_first +
+                     (group_has_super(g) ? 1 + count_gdt_blocks() : 0);
+            gdt[g].bg_block_bitmap = n_meta;
+            gdt[g].bg_inode_bitmap = n_meta + 1;
+            gdt[g].bg_inode_table = n_meta + 2;
+            gdt[g].bg_free_blocks_count =
+                count_group_blocks(g) - count_group_overhead(g);
+            gdt[g].bg_free_inodes_count = sb->s_inodes_per_group;
+        }
+        gdt[0].bg_free_inodes_count -= EXT2_GOOD_OLD_FIRST_INO - 1;
+    }
+    n_first = sb->s_first_data_block + n_group * sb->s_blocks_per_group;
+    if (group_has_super(n_group)) {
+        write_raw_blocks(n_first + 1, count_gdt_blocks(),
+                         buf + EXT2_BLOCK_SIZE);
+    }
+
+    /* metadata in use, and the bits past a short last group */
+    memset(buf, 0, EXT2_BLOCK_SIZE);
+    set_bits(0, count_group_overhead(n_group), buf);
+    set_bits(count_group_blocks(n_group), EXT2_BLOCK_SIZE * 8, buf);
+    write_raw_block(gdt[n_group].bg_block_bitmap, buf);
+
+    memset(buf, 0, EXT2_BLOCK_SIZE);
+    n_reserved = n_group ? 0 : EXT2_GOOD_OLD_FIRST_INO - 1;
+    set_bits(0, n_reserved, buf);
+    set_bits(sb->s_inodes_per_group, EXT2_BLOCK_SIZE * 8, buf);
+    write_raw_block(gdt[n_group].bg_inode_bitmap, buf);
+}
+
+/* The root directory and lost+found, with blocks kept for e2fsck. */
+void make_root_dirs() {
+    struct ext2_inode *inode;
+    struct ext2_dir_entry *dir;
+    int n_lost_inode, n_block;
+
+    init_inode(EXT2_ROOT_INO);
+    inode = locate_inode(EXT2_ROOT_INO);
+    inode->i_mode = EXT2_S_IFDIR | 0755;
+    inode->i_atime = inode->i_ctime = inode->i_mtime = sb->s_wtime;
+    mark_inode_dirty(EXT2_ROOT_INO);
+    alloc_block_any(EXT2_ROOT_INO);
+    add_dent_dir(EXT2_ROOT_INO, EXT2_ROOT_INO, ".");
+    add_dent_dir(EXT2_ROOT_INO, EXT2_ROOT_INO, "..");
+    ++locate_inode_group(EXT2_ROOT_INO)->bg_used_dirs_count;
+
+    n_lost_inode = alloc_inode_dir();
+    inode = locate_inode(n_lost_inode);
+    inode->i_mode = EXT2_S_IFDIR | 0700;
+    inode->osd1 = 0;
+    inode->i_atime = inode->i_ctime = inode->i_mtime = sb->s_wtime;
+    mark_inode_dirty(n_lost_inode);
+    add_dent_dir(n_lost_inode, EXT2_ROOT_INO, "lost+found");
+    alloc_block_any(n_lost_inode);
+    add_dent_dir(n_lost_inode, n_lost_inode, ".");
+    add_dent_dir(EXT2_ROOT_INO, n_lost_inode, "..");
+    for (int i = 1; i < LOST_FOUND_BLOCKS; ++i) {
+        n_block = alloc_block_any(n_lost_inode);
+        dir = locate_meta_block(n_block);
+        init_dent(dir, 0, EXT2_BLOCK_SIZE, 0, 0, "");
+        mark_block_dirty(n_block);
+    }
+    drop_dir_gaps(n_lost_inode);
+    ++locate_inode_group(n_lost_inode)->bg_used_dirs_count;
+    mark_group_dirty(0);
+}
+
+/* ------------------- image regions ------------------- */
+
+/* ------------------- change tracking ------------------- */
+
+void make_change_map_path(char *path) {
+    if (snprintf(path, PATH_MAX, "%s.cbt", image_path) >= PATH_MAX) {
+        fprintf(stderr, "image path too long\n");
+        exit(ENAMETOOLONG);
+    }
+}
+
+/* Tracking is on for images that have a sidecar, see init_change_map(). */
+void load_change_map() {
+    char path[PATH_MAX];
+    struct change_map_header header;
+    FILE *fp;
+
+    make_change_map_path(path);
+    if (!(fp = fopen(path, "rb"))) {
+        return;
+    }
+
+    if (!(change_map = malloc(count_blockio_blocks() * sizeof(int)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, CHANGE_MAP_MAGIC, sizeof(header.magic)) ||
+        header.n_blocks != count_blockio_blocks() ||
+        fread(change_map, sizeof(int), header.n_blocks, fp) !=
+            header.n_blocks) {
+        fprintf(stderr, "%s is not a change map of %s\n", path, image_path);
+        exit(EINVAL);
+    }
+    fclose(fp);
+}
+
+/*
+ * Stamp the blocks written this session with a new generation. The map
+ * is stored (atomically, by rename) before the superblock that names
+ * the generation, so a crash can only make a later delta larger.
+ */
+void save_change_map() {
+    char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+    struct change_map_header header;
+    unsigned int generation;
+    int *blocks;
+    int num;
+    FILE *fp;
+
+    if (!(blocks = malloc(count_blockio_blocks() * sizeof(int)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+
+    generation = CHANGE_GEN(sb) + 1;
+    if ((num = take_changed_blocks(blocks)) > 0) {
+        CHANGE_GEN(sb) = generation;
+        mark_counts_dirty();
+        blocks[num++] = 1;
+        for (int i = 0; i < num; ++i) {
+            change_map[blocks[i]] = generation;
+        }
+
+        make_change_map_path(path);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        memcpy(header.magic, CHANGE_MAP_MAGIC, sizeof(header.magic));
+        header.n_blocks = count_blockio_blocks();
+        header.generation = generation;
+        if (!(fp = fopen(tmp_path, "wb")) ||
+            fwrite(&header, sizeof(header), 1, fp) != 1 ||
+            fwrite(change_map, sizeof(int), header.n_blocks, fp) !=
+                header.n_blocks ||
+            fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0 ||
+            rename(tmp_path, path) != 0) {
+            perror(tmp_path);
+            exit(EIO);
+        }
+    }
+
+    free(blocks);
+    free(change_map);
+    change_map = NULL;
+}
+
+void write_stream(const void *buf, size_t len, FILE *out) {
+    if (fwrite(buf, 1, len, out) != len) {
+        perror("fwrite");
+        exit(EIO);
+    }
+}
+
+void read_stream(void *buf, size_t len, FILE *in) {
+    if (fread(buf, 1, len, in) != len) {
+        fprintf(stderr, "truncated delta stream\n");
+        exit(EINVAL);
+    }
+}
+
+/* The metadata of the first group and every block in use. */
+int is_block_packed(int n_block) {
+    return n_block < count_meta_blocks() ||
+           (n_block < sb->s_blocks_count && chk_blockbit(n_block));
+}
+
+/* Replay what a crash left in the journal and start logging. */
+void load_journal() {
+    struct ext2_inode *inode;
+    int *blocks;
+    int num, n_replayed;
+
+    inode = locate_inode(sb->s_journal_inum);
+    num = inode->i_size / EXT2_BLOCK_SIZE;
+
+    if (num < 1) {
+        fprintf(stderr, "journal has no blocks\n");
+        exit(EINVAL);
+    }
+    if (!(blocks = malloc(num * sizeof(int)))) {
+        perror("malloc");
+        exit(ENOMEM);
+    }
+    for (int i = 0; i < num; ++i) {
+        blocks[i] = find_block_linear(sb->s_journal_inum, i);
+    }
+
+    if ((n_replayed = open_journal(blocks, num)) > 0) {
+        fprintf(stderr, "Recovered %d transactions from the journal\n",
+                n_replayed);
+    }
+    journaled = 1;
+
+    free(blocks);
+}
+
+/*
+ * Point index i of the journal inode at n_block, allocating the indirect
+ * blocks on the way. Returns how many of those it allocated.
+ */
+int map_journal_block(int i, int n_block) {
+    struct ext2_inode *inode;
+    unsigned int *map;
+    int n_ind, n_map, per;
+
+    per = EXT2_BLOCK_SIZE / 4;
+    inode = locate_inode(EXT2_JOURNAL_INO);
+    n_map = 0;
+    if (i < 12) {
+        inode->i_block[i] = n_block;
+    } else if (i < 12 + per) {
+        if (!inode->i_block[12]) {
+            inode->i_block[12] = alloc_block();
+            ++n_map;
+        }
+        map = locate_meta_block(inode->i_block[12]);
+        map[i - 12] = n_block;
+        mark_block_dirty(inode->i_block[12]);
+    } else {
+        i -= 12 + per;
+        if (!inode->i_block[13]) {
+            inode->i_block[13] = alloc_block();
+            ++n_map;
+        }
+        if (!(n_ind = ((unsigned int *)locate_meta_block(
+                           inode->i_block[13]))[i / per])) {
+            n_ind = alloc_block();
+            ++n_map;
+            map = locate_meta_block(inode->i_block[13]);
+            map[i / per] = n_ind;
+            mark_block_dirty(inode->i_block[13]);
+        }
+        map = locate_meta_block(n_ind);
+        map[i % per] = n_block;
+        mark_block_dirty(n_ind);
+    }
+    mark_inode_dirty(EXT2_JOURNAL_INO);
+    return n_map;
+}
+
+/* Blocks from the start of the image to the end of group 0's inode table. */
+int count_meta_blocks() {
+    return gd->bg_inode_table +
+           sb->s_inodes_per_group * sizeof(struct ext2_inode) / EXT2_BLOCK_SIZE;
+}
+
+void advise_meta(int advice) { advise_blocks(0, count_meta_blocks(), advice); }
+
 /* ------------------- check type ------------------- */
 
 int get_inode_type(int n_inode) {
@@ -1091,6 +4889,19 @@ int is_inode_reg(int n_inode) {
 int is_inode_sym(int n_inode) {
     return get_inode_type(n_inode) == EXT2_S_IFLNK ? 1 : 0;
 }
+int is_inode_fastsym(int n_inode) {
+    return is_inode_sym(n_inode) && locate_inode(n_inode)->i_blocks == 0;
+}
+
+/* Permission bits, or the usual defaults for inodes created without any. */
+int get_inode_perms(int n_inode) {
+    int perms;
+
+    if ((perms = locate_inode(n_inode)->i_mode & 07777)) {
+        return perms;
+    }
+    return is_inode_dir(n_inode) ? 0755 : is_inode_sym(n_inode) ? 0777 : 0644;
+}
 
 int get_dent_type(const struct ext2_dir_entry *dent) {
     return dent->file_type & 0x7UL;
@@ -5,13 +5,61 @@
 
 #include <stdio.h>
 
+/* flags for compact_dir() */
+#define COMPACT_RECURSIVE    0x1
+#define COMPACT_SORT         0x2
+#define COMPACT_KEEP_DELETED 0x4
+
+/*
+ * Strip the options shared by every tool from argv and return the new
+ * argc. Tools parse what is left as before.
+ *   --discard     punch holes in the image file for blocks freed on close
+ *   --io=mmap     map the whole image (default)
+ *   --io=cache    pread/pwrite through an LRU buffer cache
+ *   --io=uring    buffer cache filled and flushed in io_uring batches
+ *   --cache-kb=N  buffer cache budget in KiB for --io=cache/uring
+ *   --durability=none|commit|batch  msync/fdatasync data then metadata
+ *                 never (default), after each operation, or in batches
+ *   --overlay <delta>  leave the image untouched, keep written blocks in
+ *                 a sparse delta file (see ext2_overlay)
+ *   --no-advice   skip the madvise()/read-ahead access hints
+ *   --populate-meta  fault in the metadata at open, on huge pages if allowed
+ *   --stats[=json]  print hot-path counters, page faults and the time
+ *                 spent opening, running and closing to stderr
+ *   --trace[=<file>]  latency histograms per operation and phase to
+ *                 stderr at exit, Chrome trace events to <file>; needs
+ *                 a build with -DEXT2_TRACE
+ */
+int parse_image_opts(int argc, char **argv);
 void open_image(const char *filename);
 void close_image();
 void create_dir(const char *dir_path);
 void create_reg(FILE *fp, const char *dst_path);
+void update_reg(FILE *fp, const char *dst_path);
+void append_reg(FILE *fp, const char *dst_path);
+void truncate_reg(const char *path, long size);
 void create_lnk(const char *src_path, const char *dst_path, int symlnk);
 void remove_reg_or_lnk(const char *dst_path);
+void move_path(const char *src_path, const char *dst_path);
 void restore_reg_or_lnk(const char *dst_path);
 void check_image();
+void make_image(const char *filename, int n_blocks, int inode_ratio);
+void create_journal(int n_blocks);
+void init_change_map();
+int export_delta(unsigned int since, FILE *out);
+int apply_delta(const char *filename, FILE *in);
+int pack_image(FILE *out);
+int unpack_image(const char *filename, FILE *in);
+int capture_image(const char *filename);
+void trim_image();
+void compact_dir(const char *dir_path, int flags);
+void defrag_path(const char *path);
+int lookup_path(const char *path);
+int lookup_deleted_path(const char *path);
+void import_tree(const char *src, const char *dst_path, int n_readers);
+void extract_path(const char *path, const char *dst, int recursive,
+                  int n_workers);
+void import_tar(FILE *in, const char *dst_dir);
+void export_tar(const char *path, FILE *out);
 
 #endif /* _EXT2_UTILS_ */